@@ -19,6 +19,7 @@
 #include "apex_database.h"
 #include "apex_constants.h"
 #include "apex_file.h"
+#include "apex_file_cache.h"
 #include "apexd_utils.h"
 #include "status_or.h"
 #include "string_log.h"
@@ -28,11 +29,13 @@
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 
+#include <algorithm>
 #include <filesystem>
-#include <fstream>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 using android::base::EndsWith;
 using android::base::ParseInt;
@@ -76,8 +79,10 @@ const fs::path kSysBlock = "/sys/block";
 
 class BlockDevice {
   std::string name;  // loopN, dm-N, ...
+  fs::path sysBlock;  // Where sysfs describes the block devices.
  public:
-  explicit BlockDevice(const fs::path& path) { name = path.filename(); }
+  BlockDevice(const fs::path& path, const fs::path& sysBlockDir)
+      : name(path.filename()), sysBlock(sysBlockDir) {}
 
   BlockDeviceType GetType() const {
     if (StartsWith(name, "loop")) return LoopDevice;
@@ -85,7 +90,7 @@ class BlockDevice {
     return UnknownDevice;
   }
 
-  fs::path SysPath() const { return kSysBlock / name; }
+  fs::path SysPath() const { return sysBlock / name; }
 
   fs::path DevPath() const { return kDevBlock / name; }
 
@@ -98,28 +103,44 @@ class BlockDevice {
     return StatusOr<std::string>(Trim(propertyValue));
   }
 
+  // Returns the devices this one is stacked on, ordered by name. Only the
+  // names in sysfs are read; the slaves themselves aren't probed.
   std::vector<BlockDevice> GetSlaves() const {
     std::vector<BlockDevice> slaves;
-    std::error_code ec;
     auto status = WalkDir(SysPath() / "slaves", [&](const auto& entry) {
-      BlockDevice dev(entry);
-      if (fs::is_block_file(dev.DevPath(), ec)) {
-        slaves.push_back(dev);
-      }
+      slaves.emplace_back(entry.path(), sysBlock);
     });
     if (!status.Ok()) {
       LOG(WARNING) << status.ErrorMessage();
     }
+    std::sort(slaves.begin(), slaves.end(),
+              [](const BlockDevice& a, const BlockDevice& b) {
+                return a.name < b.name;
+              });
     return slaves;
   }
 };
 
-std::pair<fs::path, fs::path> parseMountInfo(const std::string& mountInfo) {
-  const auto& tokens = Split(mountInfo, " ");
-  if (tokens.size() < 2) {
-    return std::make_pair("", "");
+// An entry of /proc/self/mountinfo. See proc(5) for the format.
+struct MountInfo {
+  std::string devNumber;  // major:minor of the mounted device.
+  std::string root;  // Directory of the filesystem that is mounted.
+  std::string mountPoint;
+  std::string source;  // e.g. /dev/block/dm-1
+};
+
+std::optional<MountInfo> parseMountInfo(const std::string& line) {
+  const auto& tokens = Split(line, " ");
+  if (tokens.size() < 6) {
+    return std::nullopt;
   }
-  return std::make_pair(tokens[0], tokens[1]);
+  // A variable number of optional fields is terminated by a single "-",
+  // followed by the filesystem type and the mount source.
+  auto separator = std::find(tokens.begin() + 6, tokens.end(), "-");
+  if (std::distance(separator, tokens.end()) < 3) {
+    return std::nullopt;
+  }
+  return MountInfo{tokens[2], tokens[3], tokens[4], *(separator + 2)};
 }
 
 std::pair<std::string, int> parseMountPoint(const std::string& mountPoint) {
@@ -169,54 +190,54 @@ inode_map scanFlattendedPackages() {
   return map;
 }
 
-StatusOr<MountedApexData> resolveMountInfo(const BlockDevice& block,
-                                           const std::string& mountPoint,
-                                           const inode_map& inodeMap) {
-  auto Error = [](auto e) { return StatusOr<MountedApexData>::MakeError(e); };
-
-  // First, see if it is bind-mount'ed to a flattened APEX
-  // This is checked first since flattened APEXes can be located in any stacked
-  // filesystem. (e.g. if / is mounted via /dev/loop1, then /proc/mounts shows
-  // that loop device as associated block device. But it is not related to APEX
-  // activation.) In any cases, comparing (dev,inode) pair with scanned
-  // flattened APEXes must identify bind-mounted APEX properly.
-  // See b/131924899.
-  auto inode = inodeFor(mountPoint);
-  if (inode.Ok()) {
-    auto iter = inodeMap.find(*inode);
-    if (iter != inodeMap.end()) {
-      return StatusOr<MountedApexData>("", iter->second, mountPoint, "");
-    }
-  }
+// The APEX file a loop or dm-verity device is backed by.
+struct ResolvedDevice {
+  std::string loopName;  // Loop device used (fs path).
+  std::string backingFile;  // Full path to the apex file.
+  std::string dmName;  // Name of the dm verity device, if any.
+  std::string hashTreeLoopName;  // Loop device of an external hashtree.
+};
+
+StatusOr<ResolvedDevice> resolveDevice(const BlockDevice& block) {
+  auto Error = [](auto e) { return StatusOr<ResolvedDevice>::MakeError(e); };
 
-  // Now, see if it is dm-verity or loop mounted
   switch (block.GetType()) {
     case LoopDevice: {
       auto backingFile = block.GetProperty("loop/backing_file");
       if (!backingFile.Ok()) {
         return Error(backingFile.ErrorStatus());
       }
-      return StatusOr<MountedApexData>(block.DevPath(), *backingFile,
-                                       mountPoint, "");
+      return StatusOr<ResolvedDevice>(
+          ResolvedDevice{block.DevPath(), *backingFile, "", ""});
     }
     case DeviceMapperDevice: {
       auto name = block.GetProperty("dm/name");
       if (!name.Ok()) {
         return Error(name.ErrorStatus());
       }
-      auto slaves = block.GetSlaves();
-      if (slaves.empty() || slaves[0].GetType() != LoopDevice) {
-        return Error("DeviceMapper device with no loop devices");
+      // The data device, plus one for the hashtree if it's external.
+      ResolvedDevice resolved;
+      resolved.dmName = *name;
+      for (const auto& slave : block.GetSlaves()) {
+        if (slave.GetType() != LoopDevice) {
+          return Error("DeviceMapper device with non-loop device " +
+                       slave.DevPath().string());
+        }
+        auto backingFile = slave.GetProperty("loop/backing_file");
+        if (!backingFile.Ok()) {
+          return Error(backingFile.ErrorStatus());
+        }
+        if (StartsWith(*backingFile, std::string(kApexHashTreeDir) + "/")) {
+          resolved.hashTreeLoopName = slave.DevPath();
+        } else {
+          resolved.loopName = slave.DevPath();
+          resolved.backingFile = *backingFile;
+        }
       }
-      // TODO(jooyung): handle multiple loop devices when hash tree is
-      // externalized
-      auto slave = slaves[0];
-      auto backingFile = slave.GetProperty("loop/backing_file");
-      if (!backingFile.Ok()) {
-        return Error(backingFile.ErrorStatus());
+      if (resolved.loopName.empty()) {
+        return Error("DeviceMapper device with no loop devices");
       }
-      return StatusOr<MountedApexData>(slave.DevPath(), *backingFile,
-                                       mountPoint, *name);
+      return StatusOr<ResolvedDevice>(std::move(resolved));
     }
     case UnknownDevice: {
       return Error("Can't resolve " + block.DevPath().string());
@@ -224,9 +245,30 @@ StatusOr<MountedApexData> resolveMountInfo(const BlockDevice& block,
   }
 }
 
+// Returns the versioned APEX mounts, i.e. /apex/<name>@<version>, of
+// |content| in the format of /proc/self/mountinfo.
+std::vector<MountInfo> parseApexMounts(const std::string& content) {
+  std::vector<MountInfo> ret;
+  for (const auto& line : Split(content, "\n")) {
+    auto mount = parseMountInfo(line);
+    if (!mount.has_value()) {
+      continue;
+    }
+    // TODO(jooyung): ignore tmp mount?
+    if (fs::path(mount->mountPoint).parent_path() != kApexRoot) {
+      continue;
+    }
+    if (isActiveMountPoint(mount->mountPoint)) {
+      continue;
+    }
+    ret.push_back(std::move(*mount));
+  }
+  return ret;
+}
+
 }  // namespace
 
-// On startup, APEX database is populated from /proc/mounts.
+// On startup, APEX database is populated from /proc/self/mountinfo.
 
 // /apex/<package-id> can be mounted from
 // - /dev/block/loopX : loop device
@@ -244,11 +286,16 @@ StatusOr<MountedApexData> resolveMountInfo(const BlockDevice& block,
 // the original APEX file.
 // Device name can be retrieved from
 // /sys/block/dm-Y/dm/name.
+// If the hashtree of the APEX is external, there is a
+// second loop device, backed by a file in kApexHashTreeDir.
 
 // In case of <flattened>, it is --bind mounted to a flattened
 // APEX directory. This is allowed only for system/product
-// partitions. So, original APEX directory can be found
-// by comparing dev/inode pair with candidates.
+// partitions. Such a mount doesn't start at the root of its
+// filesystem, which tells it apart even if that filesystem is
+// itself on a loop device (b/131924899). The original APEX
+// directory is then found by comparing dev/inode pair with
+// candidates, which are only scanned if there is such a mount.
 
 // By synchronizing the mounts info with Database on startup,
 // Apexd serves the correct package list even on the devices
@@ -256,29 +303,68 @@ StatusOr<MountedApexData> resolveMountInfo(const BlockDevice& block,
 void MountedApexDatabase::PopulateFromMounts() {
   LOG(INFO) << "Populating APEX database from mounts...";
 
-  std::unordered_map<std::string, int> activeVersions;
-  inode_map inodeToFlattendApexMap = scanFlattendedPackages();
+  std::string mountinfo;
+  if (!ReadFileToString("/proc/self/mountinfo", &mountinfo)) {
+    PLOG(ERROR) << "Failed to read /proc/self/mountinfo";
+    return;
+  }
+  PopulateFromMounts(mountinfo, kSysBlock);
+}
 
-  std::ifstream mounts("/proc/mounts");
-  std::string line;
-  while (std::getline(mounts, line)) {
-    auto [block, mountPoint] = parseMountInfo(line);
-    // TODO(jooyung): ignore tmp mount?
-    if (fs::path(mountPoint).parent_path() != kApexRoot) {
-      continue;
-    }
-    if (isActiveMountPoint(mountPoint)) {
-      continue;
+void MountedApexDatabase::PopulateFromMounts(const std::string& mountinfo,
+                                             const std::string& sysBlockDir) {
+  std::vector<MountInfo> apexMounts = parseApexMounts(mountinfo);
+
+  // Resolve each block device through sysfs once, before any mount is
+  // recorded.
+  std::unordered_map<std::string, StatusOr<ResolvedDevice>> devices;
+  for (const auto& mount : apexMounts) {
+    if (mount.root == "/" && devices.count(mount.devNumber) == 0) {
+      devices.emplace(mount.devNumber,
+                      resolveDevice(BlockDevice(mount.source, sysBlockDir)));
     }
+  }
 
-    auto mountData = resolveMountInfo(BlockDevice(block), mountPoint,
-                                      inodeToFlattendApexMap);
-    if (!mountData.Ok()) {
-      LOG(WARNING) << "Can't resolve mount info " << mountData.ErrorMessage();
-      continue;
+  std::unordered_map<std::string, int> activeVersions;
+  std::optional<inode_map> inodeToFlattendApexMap;
+  for (const auto& mount : apexMounts) {
+    const std::string& mountPoint = mount.mountPoint;
+    std::optional<MountedApexData> mountData;
+    if (mount.root != "/") {
+      if (!inodeToFlattendApexMap.has_value()) {
+        inodeToFlattendApexMap = scanFlattendedPackages();
+      }
+      auto inode = inodeFor(mountPoint);
+      if (!inode.Ok()) {
+        LOG(WARNING) << "Can't resolve mount info " << inode.ErrorMessage();
+        continue;
+      }
+      auto iter = inodeToFlattendApexMap->find(*inode);
+      if (iter == inodeToFlattendApexMap->end()) {
+        LOG(WARNING) << "Can't resolve mount info " << mountPoint
+                     << " : not a flattened APEX";
+        continue;
+      }
+      mountData.emplace("", iter->second, mountPoint, "");
+    } else {
+      const auto& device = devices.at(mount.devNumber);
+      if (!device.Ok()) {
+        LOG(WARNING) << "Can't resolve mount info " << device.ErrorMessage();
+        continue;
+      }
+      mountData.emplace(device->loopName, device->backingFile, mountPoint,
+                        device->dmName);
+      mountData->hashtree_loop_name = device->hashTreeLoopName;
     }
 
     auto [package, version] = parseMountPoint(mountPoint);
+    auto apexFile = ApexFileCache::GetInstance().Open(mountData->full_path);
+    if (apexFile.Ok()) {
+      mountData->apex_file = std::make_shared<const ApexFile>(*apexFile);
+    } else {
+      LOG(WARNING) << "Can't read " << mountData->full_path << " : "
+                   << apexFile.ErrorMessage();
+    }
     AddMountedApex(package, false, *mountData);
 
     auto active = activeVersions[package] < version;
@@ -289,7 +375,7 @@ void MountedApexDatabase::PopulateFromMounts() {
     LOG(INFO) << "Found " << mountPoint;
   }
 
-  LOG(INFO) << mounted_apexes_.size() << " packages restored.";
+  LOG(INFO) << activeVersions.size() << " packages restored.";
 }
 
 }  // namespace apex
@@ -18,7 +18,11 @@
 #define ANDROID_APEXD_APEX_DATABASE_H_
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <android-base/logging.h>
@@ -26,24 +30,35 @@
 namespace android {
 namespace apex {
 
+class ApexFile;
+
 class MountedApexDatabase {
  public:
-  // Stores associated low-level data for a mounted APEX. To conserve memory,
-  // the APEX file isn't stored, but must be opened to retrieve specific data.
+  // Stores associated low-level data for a mounted APEX, together with the
+  // metadata (manifest, key, image location) of the APEX file, so that
+  // queries about active packages don't need to reopen it.
   struct MountedApexData {
     std::string loop_name;  // Loop device used (fs path).
     std::string full_path;  // Full path to the apex file.
     std::string mount_point;  // Path this apex is mounted on.
     std::string device_name;  // Name of the dm verity device.
+    // Loop device of an external hashtree, if any (fs path).
+    std::string hashtree_loop_name;
+    // Metadata of the apex file. May be null if it couldn't be read, e.g.
+    // for mounts restored from a previous apexd instance. Not part of the
+    // ordering below.
+    std::shared_ptr<const ApexFile> apex_file;
 
     MountedApexData() {}
     MountedApexData(const std::string& loop_name, const std::string& full_path,
                     const std::string& mount_point,
-                    const std::string& device_name)
+                    const std::string& device_name,
+                    std::shared_ptr<const ApexFile> apex_file = nullptr)
         : loop_name(loop_name),
           full_path(full_path),
           mount_point(mount_point),
-          device_name(device_name) {}
+          device_name(device_name),
+          apex_file(std::move(apex_file)) {}
 
     inline bool operator<(const MountedApexData& rhs) const {
       int compare_val = loop_name.compare(rhs.loop_name);
@@ -68,135 +83,207 @@ class MountedApexDatabase {
     }
   };
 
-  inline void CheckAtMostOneLatest() {
-    for (const auto& apex_set : mounted_apexes_) {
-      size_t count = 0;
-      for (const auto& pair : apex_set.second) {
-        if (pair.second) {
-          count++;
-        }
-      }
-      CHECK_LE(count, 1u) << apex_set.first;
-    }
-  }
-
-  inline void CheckUniqueLoopDm() {
-    std::unordered_set<std::string> loop_devices;
-    std::unordered_set<std::string> dm_devices;
-    for (const auto& apex_set : mounted_apexes_) {
-      for (const auto& pair : apex_set.second) {
-        if (pair.first.loop_name != "") {
-          CHECK(loop_devices.insert(pair.first.loop_name).second)
-              << "Duplicate loop device: " << pair.first.loop_name;
-        }
-        if (pair.first.device_name != "") {
-          CHECK(dm_devices.insert(pair.first.device_name).second)
-              << "Duplicate dm device: " << pair.first.device_name;
-        }
-      }
-    }
-  }
-
   template <typename... Args>
   inline void AddMountedApex(const std::string& package, bool latest,
                              Args&&... args) {
-    auto it = mounted_apexes_.find(package);
-    if (it == mounted_apexes_.end()) {
-      auto insert_it =
-          mounted_apexes_.emplace(package, std::map<MountedApexData, bool>());
-      CHECK(insert_it.second);
-      it = insert_it.first;
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    MountedApexData data(std::forward<Args>(args)...);
+    if (data.loop_name != "") {
+      CHECK(loop_devices_.count(data.loop_name) == 0)
+          << "Duplicate loop device: " << data.loop_name;
+    }
+    if (data.hashtree_loop_name != "") {
+      CHECK(loop_devices_.count(data.hashtree_loop_name) == 0 &&
+            data.hashtree_loop_name != data.loop_name)
+          << "Duplicate loop device: " << data.hashtree_loop_name;
+    }
+    if (data.device_name != "") {
+      CHECK(dm_devices_.count(data.device_name) == 0)
+          << "Duplicate dm device: " << data.device_name;
     }
 
-    auto check_it = it->second.emplace(
-        MountedApexData(std::forward<Args>(args)...), latest);
+    PackageMounts& mounts = mounted_apexes_[package];
+    CHECK(!latest || mounts.latest == mounts.data.end()) << package;
+    auto check_it = mounts.data.emplace(std::move(data), latest);
     CHECK(check_it.second);
+    auto it = check_it.first;
 
-    CheckAtMostOneLatest();
-    CheckUniqueLoopDm();
+    if (latest) {
+      mounts.latest = it;
+    }
+    full_path_index_.emplace(it->first.full_path, &it->first);
+    if (it->first.loop_name != "") {
+      loop_devices_.insert(it->first.loop_name);
+    }
+    if (it->first.hashtree_loop_name != "") {
+      loop_devices_.insert(it->first.hashtree_loop_name);
+    }
+    if (it->first.device_name != "") {
+      dm_devices_.insert(it->first.device_name);
+    }
+    generation_++;
   }
 
   inline void RemoveMountedApex(const std::string& package,
                                 const std::string& full_path) {
-    auto it = mounted_apexes_.find(package);
-    if (it == mounted_apexes_.end()) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto pkg_it = mounted_apexes_.find(package);
+    if (pkg_it == mounted_apexes_.end()) {
+      return;
+    }
+    PackageMounts& mounts = pkg_it->second;
+    auto it = FindLocked(mounts, full_path);
+    if (it == mounts.data.end()) {
       return;
     }
 
-    auto& pkg_map = it->second;
-
-    for (auto pkg_it = pkg_map.begin(); pkg_it != pkg_map.end(); ++pkg_it) {
-      if (pkg_it->first.full_path == full_path) {
-        pkg_map.erase(pkg_it);
-        return;
+    auto range = full_path_index_.equal_range(full_path);
+    for (auto index_it = range.first; index_it != range.second; ++index_it) {
+      if (index_it->second == &it->first) {
+        full_path_index_.erase(index_it);
+        break;
       }
     }
+    loop_devices_.erase(it->first.loop_name);
+    loop_devices_.erase(it->first.hashtree_loop_name);
+    dm_devices_.erase(it->first.device_name);
+    if (mounts.latest == it) {
+      mounts.latest = mounts.data.end();
+    }
+    mounts.data.erase(it);
+    if (mounts.data.empty()) {
+      mounted_apexes_.erase(pkg_it);
+    }
+    generation_++;
   }
 
   inline void SetLatest(const std::string& package,
                         const std::string& full_path) {
-    auto it = mounted_apexes_.find(package);
-    CHECK(it != mounted_apexes_.end());
-
-    auto& pkg_map = it->second;
-
-    for (auto pkg_it = pkg_map.begin(); pkg_it != pkg_map.end(); ++pkg_it) {
-      if (pkg_it->first.full_path == full_path) {
-        pkg_it->second = true;
-        for (auto reset_it = pkg_map.begin(); reset_it != pkg_map.end();
-             ++reset_it) {
-          if (reset_it != pkg_it) {
-            reset_it->second = false;
-          }
-        }
-        return;
-      }
-    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto pkg_it = mounted_apexes_.find(package);
+    CHECK(pkg_it != mounted_apexes_.end());
+
+    PackageMounts& mounts = pkg_it->second;
+    auto it = FindLocked(mounts, full_path);
+    CHECK(it != mounts.data.end())
+        << "Did not find " << package << " " << full_path;
 
-    LOG(FATAL) << "Did not find " << package << " " << full_path;
+    if (mounts.latest != mounts.data.end()) {
+      mounts.latest->second = false;
+    }
+    it->second = true;
+    mounts.latest = it;
+    generation_++;
   }
 
   inline void UnsetLatestForall(const std::string& package) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
     auto it = mounted_apexes_.find(package);
     if (it == mounted_apexes_.end()) {
       return;
     }
-    for (auto& data : it->second) {
-      data.second = false;
+    PackageMounts& mounts = it->second;
+    if (mounts.latest != mounts.data.end()) {
+      mounts.latest->second = false;
+      mounts.latest = mounts.data.end();
+      generation_++;
     }
   }
 
+  // Returns a counter that is incremented by every change of the database, so
+  // that results derived from it can be cached.
+  inline uint64_t GetGeneration() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return generation_;
+  }
+
+  // Calls |handler| for every mounted version of |package|. The database is
+  // locked for reading meanwhile, so |handler| must not modify it.
   template <typename T>
   inline void ForallMountedApexes(const std::string& package,
                                   const T& handler) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
     auto it = mounted_apexes_.find(package);
     if (it == mounted_apexes_.end()) {
       return;
     }
-    for (auto& pair : it->second) {
+    for (auto& pair : it->second.data) {
       handler(pair.first, pair.second);
     }
   }
 
+  // Calls |handler| for every mounted package. The database is locked for
+  // reading meanwhile, so |handler| must not modify it.
   template <typename T>
   inline void ForallMountedApexes(const T& handler) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
     for (const auto& pkg : mounted_apexes_) {
-      for (const auto& pair : pkg.second) {
+      for (const auto& pair : pkg.second.data) {
         handler(pkg.first, pair.first, pair.second);
       }
     }
   }
 
+  // Adds the packages that are mounted in the current mount namespace.
   void PopulateFromMounts();
+  // Like above, but the mounts are read from |mountinfo|, which has the
+  // format of /proc/self/mountinfo, and their block devices are resolved in
+  // |sys_block_dir| instead of /sys/block.
+  void PopulateFromMounts(const std::string& mountinfo,
+                          const std::string& sys_block_dir);
+
+  // Forgets all mounted packages, without unmounting them.
+  inline void Clear() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    mounted_apexes_.clear();
+    full_path_index_.clear();
+    loop_devices_.clear();
+    dm_devices_.clear();
+    generation_++;
+  }
 
  private:
-  // A map from package name to mounted apexes.
-  // Note: using std::maps to
-  //         a) so we do not have to worry about iterator invalidation.
-  //         b) do not have to const_cast (over std::set)
-  // TODO: Eventually this structure (and functions) need to be guarded by
-  // locks.
-  std::map<std::string, std::map<MountedApexData, bool>> mounted_apexes_;
+  using MountMap = std::map<MountedApexData, bool>;
+
+  struct PackageMounts {
+    // All mounted versions of the package, mapped to whether they're latest.
+    MountMap data;
+    // The entry of |data| that is latest, or data.end() if there is none.
+    MountMap::iterator latest = data.end();
+
+    PackageMounts() = default;
+    // |latest| points into |data|, so copying would leave it dangling.
+    PackageMounts(const PackageMounts&) = delete;
+    PackageMounts& operator=(const PackageMounts&) = delete;
+  };
+
+  // Returns the first mounted version of |mounts| for |full_path|.
+  inline MountMap::iterator FindLocked(PackageMounts& mounts,
+                                       const std::string& full_path) {
+    auto result = mounts.data.end();
+    auto range = full_path_index_.equal_range(full_path);
+    for (auto index_it = range.first; index_it != range.second; ++index_it) {
+      auto it = mounts.data.find(*index_it->second);
+      if (it != mounts.data.end() && &it->first == index_it->second &&
+          (result == mounts.data.end() || it->first < result->first)) {
+        result = it;
+      }
+    }
+    return result;
+  }
+
+  // Guards all of the members below. Activation updates the database while
+  // binder threads query it.
+  mutable std::shared_mutex mutex_;
+  // A map from package name to mounted apexes. Nodes of std::map are stable,
+  // which the indexes below rely on.
+  std::map<std::string, PackageMounts> mounted_apexes_;
+  // Secondary indexes over all mounted apexes.
+  std::unordered_multimap<std::string, const MountedApexData*>
+      full_path_index_;
+  std::unordered_set<std::string> loop_devices_;
+  std::unordered_set<std::string> dm_devices_;
+  uint64_t generation_ = 0;
 };
 
 }  // namespace apex
@@ -14,8 +14,11 @@
  * limitations under the License.
  */
 
+#include <atomic>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 #include <android-base/macros.h>
 #include <gtest/gtest.h>
@@ -183,6 +186,126 @@ TEST(ApexDatabaseTest, MountMultiple) {
                               kMountPoint[3], kDeviceName[3]));
 }
 
+std::string GetLatest(const MountedApexDatabase& db,
+                      const std::string& package) {
+  std::string latest;
+  db.ForallMountedApexes(package, [&](const MountedApexData& d, bool b) {
+    if (b) {
+      latest = d.full_path;
+    }
+  });
+  return latest;
+}
+
+TEST(ApexDatabaseTest, SetLatest) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", true, "loop", "path", "mount", "dm");
+  db.AddMountedApex("package", false, "loop2", "path2", "mount2", "dm2");
+  db.AddMountedApex("package2", true, "loop3", "path3", "mount3", "dm3");
+  EXPECT_EQ("path", GetLatest(db, "package"));
+
+  db.SetLatest("package", "path2");
+  EXPECT_EQ("path2", GetLatest(db, "package"));
+  EXPECT_EQ("path3", GetLatest(db, "package2"));
+
+  db.UnsetLatestForall("package");
+  EXPECT_EQ("", GetLatest(db, "package"));
+  EXPECT_EQ("path3", GetLatest(db, "package2"));
+
+  db.SetLatest("package", "path");
+  db.RemoveMountedApex("package", "path");
+  EXPECT_EQ("", GetLatest(db, "package"));
+  // A new latest version can be added once the old one is gone.
+  db.AddMountedApex("package", true, "loop4", "path4", "mount4", "dm4");
+  EXPECT_EQ("path4", GetLatest(db, "package"));
+}
+
+TEST(ApexDatabaseTest, RemoveReleasesDevices) {
+  MountedApexDatabase db;
+  db.AddMountedApex("package", false, "loop", "path", "mount", "dm");
+  db.RemoveMountedApex("package", "path");
+  ASSERT_EQ(CountPackages(db), 0u);
+
+  // The loop and dm devices may be reused by another package.
+  db.AddMountedApex("package2", false, "loop", "path2", "mount2", "dm");
+  EXPECT_TRUE(Contains(db, "package2", "loop", "path2", "mount2", "dm"));
+
+  // Removing an unknown path is a no-op.
+  db.RemoveMountedApex("package2", "path");
+  db.RemoveMountedApex("package3", "path2");
+  EXPECT_EQ(CountPackages(db), 1u);
+}
+
+TEST(ApexDatabaseTest, RemoveReleasesHashTreeDevice) {
+  MountedApexDatabase db;
+  MountedApexData data("loop", "path", "mount", "dm");
+  data.hashtree_loop_name = "loop2";
+  db.AddMountedApex("package", false, data);
+  db.RemoveMountedApex("package", "path");
+
+  db.AddMountedApex("package2", false, "loop2", "path2", "mount2", "dm2");
+  EXPECT_TRUE(Contains(db, "package2", "loop2", "path2", "mount2", "dm2"));
+}
+
+TEST(ApexDatabaseTest, GenerationChangesOnUpdate) {
+  MountedApexDatabase db;
+  uint64_t generation = db.GetGeneration();
+  auto changed = [&]() {
+    uint64_t previous = generation;
+    generation = db.GetGeneration();
+    return generation != previous;
+  };
+
+  db.AddMountedApex("package", false, "loop", "path", "mount", "dm");
+  EXPECT_TRUE(changed());
+  db.SetLatest("package", "path");
+  EXPECT_TRUE(changed());
+  db.UnsetLatestForall("package");
+  EXPECT_TRUE(changed());
+  db.UnsetLatestForall("package");
+  EXPECT_FALSE(changed());
+  db.RemoveMountedApex("package", "unknown");
+  EXPECT_FALSE(changed());
+  db.RemoveMountedApex("package", "path");
+  EXPECT_TRUE(changed());
+}
+
+TEST(ApexDatabaseTest, ConcurrentReadersAndWriter) {
+  constexpr size_t kCount = 200;
+  MountedApexDatabase db;
+  std::atomic<bool> done(false);
+
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < 4; ++i) {
+    readers.emplace_back([&]() {
+      while (!done) {
+        size_t latest = 0;
+        db.ForallMountedApexes(
+            [&](const std::string& p ATTRIBUTE_UNUSED,
+                const MountedApexData& d ATTRIBUTE_UNUSED,
+                bool b) { latest += b ? 1 : 0; });
+        // Each package has at most one latest version at any time.
+        EXPECT_LE(latest, kCount);
+      }
+    });
+  }
+
+  for (size_t i = 0; i < kCount; ++i) {
+    const std::string suffix = std::to_string(i);
+    db.AddMountedApex("package" + suffix, true, "loop" + suffix,
+                      "path" + suffix, "mount" + suffix, "dm" + suffix);
+  }
+  for (size_t i = 0; i < kCount; i += 2) {
+    const std::string suffix = std::to_string(i);
+    db.RemoveMountedApex("package" + suffix, "path" + suffix);
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(CountPackages(db), kCount / 2);
+}
+
 #pragma clang diagnostic push
 // error: 'ReturnSentinel' was marked unused but was used
 // [-Werror,-Wused-but-marked-unused]
@@ -208,6 +331,19 @@ TEST(MountedApexDataTest, NoDuplicateDm) {
       "Duplicate dm device: dm");
 }
 
+TEST(MountedApexDataTest, NoDuplicateHashTreeLoop) {
+  ASSERT_DEATH(
+      {
+        MountedApexDatabase db;
+        MountedApexData data("loop", "path", "mount", "dm");
+        data.hashtree_loop_name = "loop2";
+        db.AddMountedApex("package", false, data);
+        db.AddMountedApex("package2", false, "loop2", "path2", "mount2",
+                          "dm2");
+      },
+      "Duplicate loop device: loop2");
+}
+
 #pragma clang diagnostic pop
 
 }  // namespace
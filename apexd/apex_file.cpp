@@ -23,6 +23,9 @@
 
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -80,12 +83,41 @@ bool isFlattenedApex(const std::string& path) {
   return true;
 }
 
+namespace {
+
+// Reads the content of |entry| into |content|. Entries that are stored
+// uncompressed, like the manifest and the public key, are read from |fd|
+// directly instead of going through the extraction code.
+Status readEntry(ZipArchiveHandle handle, int fd, ZipEntry* entry,
+                 std::string* content) {
+  const uint32_t length = entry->uncompressed_length;
+  content->resize(length, '\0');
+  if (length == 0) {
+    return Status::Success();
+  }
+  if (entry->method == kCompressStored) {
+    if (!ReadFullyAtOffset(fd, &(*content)[0], length, entry->offset)) {
+      return Status::Fail(PStringLog() << "Failed to read entry");
+    }
+    return Status::Success();
+  }
+  int32_t ret = ExtractToMemory(
+      handle, entry, reinterpret_cast<uint8_t*>(&(*content)[0]), length);
+  if (ret != 0) {
+    return Status::Fail(ErrorCodeString(ret));
+  }
+  return Status::Success();
+}
+
+}  // namespace
+
 StatusOr<ApexFile> ApexFile::Open(const std::string& path) {
   bool flattened;
   int32_t image_offset;
   size_t image_size;
   std::string manifest_content;
   std::string pubkey;
+  std::shared_ptr<unique_fd> fd;
 
   if (isFlattenedApex(path)) {
     flattened = true;
@@ -110,10 +142,20 @@ StatusOr<ApexFile> ApexFile::Open(const std::string& path) {
   } else {
     flattened = false;
 
+    // The same descriptor is used for parsing the archive here and for reading
+    // the AVB footer and vbmeta in VerifyApexVerity().
+    fd = std::make_shared<unique_fd>(
+        TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd->get() == -1) {
+      std::string err = PStringLog() << "Failed to open package " << path;
+      return StatusOr<ApexFile>::MakeError(err);
+    }
+
     ZipArchiveHandle handle;
     auto handle_guard =
         android::base::make_scope_guard([&handle] { CloseArchive(handle); });
-    int ret = OpenArchive(path.c_str(), &handle);
+    int ret = OpenArchiveFd(fd->get(), path.c_str(), &handle,
+                            /* assume_ownership= */ false);
     if (ret < 0) {
       std::string err = StringLog() << "Failed to open package " << path << ": "
                                     << ErrorCodeString(ret);
@@ -140,29 +182,22 @@ StatusOr<ApexFile> ApexFile::Open(const std::string& path) {
       return StatusOr<ApexFile>::MakeError(err);
     }
 
-    uint32_t length = entry.uncompressed_length;
-    manifest_content.resize(length, '\0');
-    ret = ExtractToMemory(handle, &entry,
-                          reinterpret_cast<uint8_t*>(&(manifest_content)[0]),
-                          length);
-    if (ret != 0) {
+    Status st = readEntry(handle, fd->get(), &entry, &manifest_content);
+    if (!st.Ok()) {
       std::string err = StringLog()
                         << "Failed to extract manifest from package " << path
-                        << ": " << ErrorCodeString(ret);
+                        << ": " << st.ErrorMessage();
       return StatusOr<ApexFile>::MakeError(err);
     }
 
     ret = FindEntry(handle, ZipString(kBundledPublicKeyFilename), &entry);
     if (ret >= 0) {
       LOG(VERBOSE) << "Found bundled key in package " << path;
-      length = entry.uncompressed_length;
-      pubkey.resize(length, '\0');
-      ret = ExtractToMemory(handle, &entry,
-                            reinterpret_cast<uint8_t*>(&(pubkey)[0]), length);
-      if (ret != 0) {
+      st = readEntry(handle, fd->get(), &entry, &pubkey);
+      if (!st.Ok()) {
         std::string err = StringLog()
                           << "Failed to extract public key from package "
-                          << path << ": " << ErrorCodeString(ret);
+                          << path << ": " << st.ErrorMessage();
         return StatusOr<ApexFile>::MakeError(err);
       }
     }
@@ -174,7 +209,7 @@ StatusOr<ApexFile> ApexFile::Open(const std::string& path) {
   }
 
   ApexFile apexFile(path, flattened, image_offset, image_size, *manifest,
-                    pubkey);
+                    pubkey, std::move(fd));
   return StatusOr<ApexFile>(std::move(apexFile));
 }
 
@@ -186,62 +221,67 @@ static constexpr const char* kApexKeyProp = "apex.key";
 
 static constexpr int kVbMetaMaxSize = 64 * 1024;
 
-std::string bytes_to_hex(const uint8_t* bytes, size_t bytes_len) {
-  std::ostringstream s;
-
-  s << std::hex << std::setfill('0');
-  for (size_t i = 0; i < bytes_len; i++) {
-    s << std::setw(2) << static_cast<int>(bytes[i]);
-  }
-  return s.str();
-}
+// Number of bytes read from the end of an image to get its AVB footer.
+static constexpr size_t kImageTailSize = 16 * 1024;
 
-std::string getSalt(const AvbHashtreeDescriptor& desc,
-                    const uint8_t* trailingData) {
+std::string_view getSalt(const AvbHashtreeDescriptor& desc,
+                         const uint8_t* trailingData) {
   const uint8_t* desc_salt = trailingData + desc.partition_name_len;
 
-  return bytes_to_hex(desc_salt, desc.salt_len);
+  return std::string_view(reinterpret_cast<const char*>(desc_salt),
+                          desc.salt_len);
 }
 
-std::string getDigest(const AvbHashtreeDescriptor& desc,
-                      const uint8_t* trailingData) {
+std::string_view getDigest(const AvbHashtreeDescriptor& desc,
+                           const uint8_t* trailingData) {
   const uint8_t* desc_digest =
       trailingData + desc.partition_name_len + desc.salt_len;
 
-  return bytes_to_hex(desc_digest, desc.root_digest_len);
+  return std::string_view(reinterpret_cast<const char*>(desc_digest),
+                          desc.root_digest_len);
 }
 
-StatusOr<std::unique_ptr<AvbFooter>> getAvbFooter(const ApexFile& apex,
-                                                  const unique_fd& fd) {
-  std::array<uint8_t, AVB_FOOTER_SIZE> footer_data;
-  auto footer = std::make_unique<AvbFooter>();
-
-  // The AVB footer is located in the last part of the image
-  off_t offset = apex.GetImageSize() + apex.GetImageOffset() - AVB_FOOTER_SIZE;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret == -1) {
-    return StatusOr<std::unique_ptr<AvbFooter>>::MakeError(
-        PStringLog() << "Couldn't seek to AVB footer");
+// The end of an image, which holds its AVB footer. vbmeta is usually right
+// before the footer and only a few KiB large, so it is read in the same go.
+struct ImageTail {
+  AvbFooter footer;
+  // Bytes [offset, offset + size) of the image, ending with the footer.
+  std::unique_ptr<uint8_t[]> data;
+  uint64_t offset;
+  size_t size;
+};
+
+StatusOr<ImageTail> readImageTail(const ApexFile& apex, int fd) {
+  ImageTail tail;
+  tail.size = std::min<size_t>(apex.GetImageSize(), kImageTailSize);
+  if (tail.size < AVB_FOOTER_SIZE) {
+    return StatusOr<ImageTail>::MakeError(
+        StringLog() << "Image is too small for an AVB footer");
   }
-
-  ret = read(fd, footer_data.data(), AVB_FOOTER_SIZE);
-  if (ret != AVB_FOOTER_SIZE) {
-    return StatusOr<std::unique_ptr<AvbFooter>>::MakeError(
-        PStringLog() << "Couldn't read AVB footer");
+  tail.offset = apex.GetImageSize() - tail.size;
+  tail.data.reset(new uint8_t[tail.size]);
+
+  // The descriptor may be shared with other threads, so don't touch its file
+  // offset.
+  if (!ReadFullyAtOffset(fd, tail.data.get(), tail.size,
+                         apex.GetImageOffset() + tail.offset)) {
+    return StatusOr<ImageTail>::MakeError(PStringLog()
+                                          << "Couldn't read AVB footer");
   }
 
-  if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_data.data(),
-                                        footer.get())) {
-    return StatusOr<std::unique_ptr<AvbFooter>>::MakeError(
+  const uint8_t* footer_data = tail.data.get() + tail.size - AVB_FOOTER_SIZE;
+  if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_data,
+                                        &tail.footer)) {
+    return StatusOr<ImageTail>::MakeError(
         StringLog() << "AVB footer verification failed.");
   }
 
   LOG(VERBOSE) << "AVB footer verification successful.";
-  return StatusOr<std::unique_ptr<AvbFooter>>(std::move(footer));
+  return StatusOr<ImageTail>(std::move(tail));
 }
 
 Status verifyPublicKey(const uint8_t* key, size_t length,
-                       std::string public_key_content) {
+                       const std::string& public_key_content) {
   if (public_key_content.length() != length ||
       memcmp(&public_key_content[0], key, length) != 0) {
     return Status::Fail("Failed to compare the bundled public key with key");
@@ -330,19 +370,29 @@ Status verifyVbMetaSignature(const ApexFile& apex, const uint8_t* data,
 }
 
 StatusOr<std::unique_ptr<uint8_t[]>> verifyVbMeta(const ApexFile& apex,
-                                                  const unique_fd& fd,
-                                                  const AvbFooter& footer) {
+                                                  int fd,
+                                                  const ImageTail& tail) {
+  const AvbFooter& footer = tail.footer;
   if (footer.vbmeta_size > kVbMetaMaxSize) {
     return StatusOr<std::unique_ptr<uint8_t[]>>::MakeError(
         "VbMeta size in footer exceeds kVbMetaMaxSize.");
   }
 
-  off_t offset = apex.GetImageOffset() + footer.vbmeta_offset;
   std::unique_ptr<uint8_t[]> vbmeta_buf(new uint8_t[footer.vbmeta_size]);
-
-  if (!ReadFullyAtOffset(fd, vbmeta_buf.get(), footer.vbmeta_size, offset)) {
-    return StatusOr<std::unique_ptr<uint8_t[]>>::MakeError(
-        PStringLog() << "Couldn't read AVB meta-data");
+  // Only read vbmeta separately if it wasn't read along with the footer.
+  if (footer.vbmeta_offset >= tail.offset &&
+      footer.vbmeta_offset - tail.offset <= tail.size &&
+      footer.vbmeta_size <= tail.size - (footer.vbmeta_offset - tail.offset)) {
+    memcpy(vbmeta_buf.get(),
+           tail.data.get() + (footer.vbmeta_offset - tail.offset),
+           footer.vbmeta_size);
+  } else {
+    off_t offset = apex.GetImageOffset() + footer.vbmeta_offset;
+    if (!ReadFullyAtOffset(fd, vbmeta_buf.get(), footer.vbmeta_size,
+                           offset)) {
+      return StatusOr<std::unique_ptr<uint8_t[]>>::MakeError(
+          PStringLog() << "Couldn't read AVB meta-data");
+    }
   }
 
   Status st = verifyVbMetaSignature(apex, vbmeta_buf.get(), footer.vbmeta_size);
@@ -399,30 +449,114 @@ StatusOr<std::unique_ptr<AvbHashtreeDescriptor>> verifyDescriptor(
       std::move(verifiedDesc));
 }
 
+// Returns the key that the vbmeta of |apex| must be signed with, as checked
+// by verifyVbMetaSignature().
+std::optional<std::string> getExpectedPublicKey(const ApexFile& apex) {
+  StatusOr<const std::string> public_key =
+      getApexKey(apex.GetManifest().name());
+  if (public_key.Ok()) {
+    return *public_key;
+  }
+  if (kDebugAllowBundledKey) {
+    return apex.GetBundledPublicKey();
+  }
+  return std::nullopt;
+}
+
+// Results of ApexFile::VerifyApexVerity(), so that the vbmeta signature of an
+// unchanged file is checked only once per process. Files are identified by
+// their FileIdentity, and an entry is only used for the key it was verified
+// with.
+class VerityCache {
+ public:
+  static VerityCache& GetInstance() {
+    static VerityCache instance;
+    return instance;
+  }
+
+  std::optional<ApexVerityData> Get(const FileIdentity& id,
+                                    const std::string& public_key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end() || it->second.public_key != public_key) {
+      return std::nullopt;
+    }
+    // The vbmeta buffer is shared, so the views into it stay valid.
+    ApexVerityData data;
+    data.desc = std::make_unique<AvbHashtreeDescriptor>(it->second.desc);
+    data.vbmeta = it->second.vbmeta;
+    data.salt = it->second.salt;
+    data.root_digest = it->second.root_digest;
+    return data;
+  }
+
+  void Put(const FileIdentity& id, const std::string& public_key,
+           const ApexVerityData& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.size() >= kMaxEntries) {
+      // Only replaced files accumulate, so this is rare.
+      entries_.clear();
+    }
+    entries_[id] = Entry{public_key, *data.desc, data.vbmeta, data.salt,
+                         data.root_digest};
+  }
+
+ private:
+  static constexpr size_t kMaxEntries = 256;
+
+  struct Entry {
+    std::string public_key;
+    AvbHashtreeDescriptor desc;
+    std::shared_ptr<const uint8_t[]> vbmeta;
+    std::string_view salt;
+    std::string_view root_digest;
+  };
+
+  std::mutex mutex_;
+  std::map<FileIdentity, Entry> entries_;
+};
+
 }  // namespace
 
 StatusOr<ApexVerityData> ApexFile::VerifyApexVerity() const {
   ApexVerityData verityData;
 
-  unique_fd fd(open(GetPath().c_str(), O_RDONLY | O_CLOEXEC));
-  if (fd.get() == -1) {
-    return StatusOr<ApexVerityData>::MakeError(PStringLog() << "Failed to open "
-                                                            << GetPath());
+  unique_fd opened_fd;
+  int fd = fd_ != nullptr ? fd_->get() : -1;
+  if (fd == -1) {
+    opened_fd.reset(open(GetPath().c_str(), O_RDONLY | O_CLOEXEC));
+    if (opened_fd.get() == -1) {
+      return StatusOr<ApexVerityData>::MakeError(
+          PStringLog() << "Failed to open " << GetPath());
+    }
+    fd = opened_fd.get();
   }
 
-  StatusOr<std::unique_ptr<AvbFooter>> footer = getAvbFooter(*this, fd);
-  if (!footer.Ok()) {
-    return StatusOr<ApexVerityData>::MakeError(footer.ErrorMessage());
+  struct stat st;
+  std::optional<FileIdentity> file_id;
+  std::optional<std::string> public_key = getExpectedPublicKey(*this);
+  if (public_key.has_value() && fstat(fd, &st) == 0) {
+    file_id = FileIdentity::FromStat(st);
+    auto cached = VerityCache::GetInstance().Get(*file_id, *public_key);
+    if (cached.has_value()) {
+      LOG(VERBOSE) << GetPath() << ": using cached verity data";
+      return StatusOr<ApexVerityData>(std::move(*cached));
+    }
+  }
+
+  StatusOr<ImageTail> tail = readImageTail(*this, fd);
+  if (!tail.Ok()) {
+    return StatusOr<ApexVerityData>::MakeError(tail.ErrorMessage());
   }
 
   StatusOr<std::unique_ptr<uint8_t[]>> vbmeta_data =
-      verifyVbMeta(*this, fd, **footer);
+      verifyVbMeta(*this, fd, *tail);
   if (!vbmeta_data.Ok()) {
     return StatusOr<ApexVerityData>::MakeError(vbmeta_data.ErrorMessage());
   }
 
   StatusOr<const AvbHashtreeDescriptor*> descriptor =
-      findDescriptor(vbmeta_data->get(), (*footer)->vbmeta_size);
+      findDescriptor(vbmeta_data->get(), tail->footer.vbmeta_size);
   if (!descriptor.Ok()) {
     return StatusOr<ApexVerityData>::MakeError(descriptor.ErrorMessage());
   }
@@ -440,7 +574,13 @@ StatusOr<ApexVerityData> ApexFile::VerifyApexVerity() const {
       (const uint8_t*)*descriptor + sizeof(AvbHashtreeDescriptor);
   verityData.salt = getSalt(*verityData.desc, trailingData);
   verityData.root_digest = getDigest(*verityData.desc, trailingData);
+  verityData.vbmeta = std::move(*vbmeta_data);
 
+  // Not cached if the file changed while it was being verified.
+  if (file_id.has_value() && fstat(fd, &st) == 0 &&
+      FileIdentity::FromStat(st) == *file_id) {
+    VerityCache::GetInstance().Put(*file_id, *public_key, verityData);
+  }
   return StatusOr<ApexVerityData>(std::move(verityData));
 }
 
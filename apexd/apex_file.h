@@ -19,7 +19,9 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <android-base/unique_fd.h>
 #include <ziparchive/zip_archive.h>
 
 #include "apex_constants.h"
@@ -34,8 +36,11 @@ namespace apex {
 // Data needed to construct a valid VerityTable
 struct ApexVerityData {
   std::unique_ptr<AvbHashtreeDescriptor> desc;
-  std::string salt;
-  std::string root_digest;
+  // The verified vbmeta image, which |salt| and |root_digest| point into.
+  std::shared_ptr<const uint8_t[]> vbmeta;
+  // Binary salt and root digest of the hashtree.
+  std::string_view salt;
+  std::string_view root_digest;
 };
 
 // Manages the content of an APEX package and provides utilities to navigate
@@ -44,6 +49,7 @@ class ApexFile {
  public:
   static StatusOr<ApexFile> Open(const std::string& path);
   ApexFile() = delete;
+  ApexFile(const ApexFile&) = default;
   ApexFile(ApexFile&&) = default;
 
   const std::string& GetPath() const { return apex_path_; }
@@ -57,15 +63,19 @@ class ApexFile {
   Status VerifyManifestMatches(const std::string& mount_path) const;
 
  private:
+  friend class ApexFileCache;
+
   ApexFile(const std::string& apex_path, bool flattened, int32_t image_offset,
            size_t image_size, ApexManifest& manifest,
-           const std::string& apex_pubkey)
+           const std::string& apex_pubkey,
+           std::shared_ptr<android::base::unique_fd> fd = nullptr)
       : apex_path_(apex_path),
         flattened_(flattened),
         image_offset_(image_offset),
         image_size_(image_size),
         manifest_(std::move(manifest)),
-        apex_pubkey_(apex_pubkey) {}
+        apex_pubkey_(apex_pubkey),
+        fd_(std::move(fd)) {}
 
   std::string apex_path_;
   bool flattened_;
@@ -73,6 +83,9 @@ class ApexFile {
   size_t image_size_;
   ApexManifest manifest_;
   std::string apex_pubkey_;
+  // Descriptor the package was parsed from, shared between copies. Null for
+  // flattened packages and for packages that were not opened from disk.
+  std::shared_ptr<android::base::unique_fd> fd_;
 };
 
 StatusOr<std::vector<std::string>> FindApexes(
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_file_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <openssl/sha.h>
+
+#include "apex_index.pb.h"
+#include "string_log.h"
+
+using android::base::StartsWith;
+using android::base::unique_fd;
+using ::apex::proto::ApexIndex;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// The index is stored as the SHA-256 digest of the serialized ApexIndex
+// followed by the serialized ApexIndex itself.
+std::string ComputeDigest(const std::string& data) {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  return std::string(reinterpret_cast<const char*>(digest), sizeof(digest));
+}
+
+}  // namespace
+
+ApexFileCache& ApexFileCache::GetInstance() {
+  static ApexFileCache instance;
+  return instance;
+}
+
+bool ApexFileCache::GetFileIdentity(const std::string& path,
+                                    FileIdentity* identity) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  *identity = FileIdentity::FromStat(st);
+  return true;
+}
+
+StatusOr<ApexFile> ApexFileCache::Open(const std::string& path) {
+  FileIdentity identity;
+  if (!GetFileIdentity(path, &identity)) {
+    // Let ApexFile::Open deal with missing files and flattened APEXes.
+    Invalidate(path);
+    return ApexFile::Open(path);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(path);
+    if (it != entries_.end() && it->second.identity == identity) {
+      return StatusOr<ApexFile>(it->second.apex_file);
+    }
+  }
+
+  // Parse outside of the lock so that independent packages can be opened
+  // concurrently. If the file changes between stat() and Open(), the entry is
+  // stored under the stale identity and simply re-parsed on the next lookup.
+  StatusOr<ApexFile> apex_file = ApexFile::Open(path);
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.erase(path);
+  if (!apex_file.Ok()) {
+    return apex_file;
+  }
+  Entry entry{identity, *apex_file};
+  // Keeping descriptors of packages on /data open would pin files that get
+  // replaced by updates, so only those of built-in packages are retained.
+  if (!isPathForBuiltinApexes(path)) {
+    entry.apex_file.fd_.reset();
+  }
+  entries_.emplace(path, std::move(entry));
+  return apex_file;
+}
+
+bool ApexFileCache::IsCached(const std::string& path) {
+  FileIdentity identity;
+  if (!GetFileIdentity(path, &identity)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(path);
+  return it != entries_.end() && it->second.identity == identity;
+}
+
+void ApexFileCache::Invalidate(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.erase(path);
+}
+
+void ApexFileCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+}
+
+Status ApexFileCache::LoadIndex(const std::string& index_path) {
+  std::string content;
+  if (!android::base::ReadFileToString(index_path, &content)) {
+    if (errno == ENOENT) {
+      return Status::Success();
+    }
+    return Status::Fail(PStringLog() << "Failed to read " << index_path);
+  }
+  if (content.size() < SHA256_DIGEST_LENGTH) {
+    return Status::Fail(StringLog() << index_path << " is truncated");
+  }
+  const std::string payload = content.substr(SHA256_DIGEST_LENGTH);
+  if (content.compare(0, SHA256_DIGEST_LENGTH, ComputeDigest(payload)) != 0) {
+    return Status::Fail(StringLog() << "Digest mismatch in " << index_path);
+  }
+  ApexIndex index;
+  if (!index.ParseFromString(payload)) {
+    return Status::Fail(StringLog() << "Failed to parse " << index_path);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  index_payloads_[index_path] = payload;
+  for (const ApexIndex::Entry& entry : index.entries()) {
+    ApexManifest manifest;
+    if (!manifest.ParseFromString(entry.manifest())) {
+      LOG(WARNING) << "Ignoring corrupt index entry for " << entry.path();
+      continue;
+    }
+    const FileIdentity identity = {static_cast<dev_t>(entry.dev()),
+                                   static_cast<ino_t>(entry.inode()),
+                                   static_cast<off_t>(entry.size()),
+                                   entry.mtime_ns(), entry.ctime_ns()};
+    ApexFile apex_file(entry.path(), false /* flattened */,
+                       entry.image_offset(), entry.image_size(), manifest,
+                       entry.public_key());
+    entries_.erase(entry.path());
+    entries_.emplace(entry.path(), Entry{identity, std::move(apex_file)});
+  }
+  LOG(DEBUG) << "Loaded " << index.entries_size() << " entries from "
+             << index_path;
+  return Status::Success();
+}
+
+Status ApexFileCache::SaveIndex(const std::string& index_path,
+                                const std::string& dir) {
+  ApexIndex index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Sorted, so that an unchanged index serializes to the same bytes.
+    std::vector<std::string> paths;
+    for (const auto& it : entries_) {
+      paths.push_back(it.first);
+    }
+    std::sort(paths.begin(), paths.end());
+    for (const std::string& path : paths) {
+      const Entry& cached = entries_.at(path);
+      FileIdentity identity;
+      if (!StartsWith(path, dir + "/") || !GetFileIdentity(path, &identity) ||
+          identity != cached.identity) {
+        continue;
+      }
+      ApexIndex::Entry* entry = index.add_entries();
+      entry->set_path(path);
+      entry->set_dev(identity.dev);
+      entry->set_inode(identity.ino);
+      entry->set_size(identity.size);
+      entry->set_mtime_ns(identity.mtime_ns);
+      entry->set_ctime_ns(identity.ctime_ns);
+      entry->set_manifest(cached.apex_file.GetManifest().SerializeAsString());
+      entry->set_public_key(cached.apex_file.GetBundledPublicKey());
+      entry->set_image_offset(cached.apex_file.GetImageOffset());
+      entry->set_image_size(cached.apex_file.GetImageSize());
+    }
+  }
+
+  std::string payload;
+  if (!index.SerializeToString(&payload)) {
+    return Status::Fail(StringLog() << "Failed to serialize index");
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_payloads_.find(index_path);
+    if (it != index_payloads_.end() && it->second == payload) {
+      LOG(DEBUG) << index_path << " is up to date";
+      return Status::Success();
+    }
+  }
+  const std::string content = ComputeDigest(payload) + payload;
+
+  // Write to a temporary file first, so that a crash never leaves a partially
+  // written index behind.
+  const std::string tmp_path = index_path + ".tmp";
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+  if (fd.get() == -1) {
+    return Status::Fail(PStringLog() << "Failed to open " << tmp_path);
+  }
+  if (!android::base::WriteFully(fd.get(), content.data(), content.size()) ||
+      fsync(fd.get()) != 0) {
+    Status err = Status::Fail(PStringLog() << "Failed to write " << tmp_path);
+    unlink(tmp_path.c_str());
+    return err;
+  }
+  fd.reset();
+  if (rename(tmp_path.c_str(), index_path.c_str()) != 0) {
+    Status err = Status::Fail(PStringLog() << "Failed to rename " << tmp_path
+                                           << " to " << index_path);
+    unlink(tmp_path.c_str());
+    return err;
+  }
+  LOG(DEBUG) << "Saved " << index.entries_size() << " entries to "
+             << index_path;
+  std::lock_guard<std::mutex> lock(mutex_);
+  index_payloads_[index_path] = std::move(payload);
+  return Status::Success();
+}
+
+}  // namespace apex
+}  // namespace android
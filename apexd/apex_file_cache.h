@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEX_FILE_CACHE_H_
+#define ANDROID_APEXD_APEX_FILE_CACHE_H_
+
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "apex_file.h"
+#include "apexd_utils.h"
+#include "status.h"
+#include "status_or.h"
+
+namespace android {
+namespace apex {
+
+// Process-wide cache of parsed APEX packages. During boot the same package is
+// opened by several independent code paths (loop device pre-allocation, key
+// collection, activation, package queries); the cache makes sure its zip
+// central directory, manifest and public key are only parsed once.
+//
+// Entries are keyed by path and validated against the identity of the file on
+// disk (see FileIdentity), so a package that has been replaced or rewritten
+// since it was cached is transparently re-opened.
+//
+// Entries for packages on /data can be persisted in an index file, which is
+// used to seed the cache on the next boot. The index only saves re-parsing the
+// zip archive; it is not trusted for anything that is security-relevant, and
+// packages are still verified against their pre-installed keys on activation.
+class ApexFileCache {
+ public:
+  static ApexFileCache& GetInstance();
+
+  // Returns the ApexFile for |path|, parsing the package only if it isn't
+  // cached yet or has changed since it was cached. Paths that aren't regular
+  // files (e.g. flattened APEXes) are never cached.
+  StatusOr<ApexFile> Open(const std::string& path);
+  // Returns whether Open(|path|) would be served from the cache.
+  bool IsCached(const std::string& path);
+
+  // Drops the cached entry for |path|, if any.
+  void Invalidate(const std::string& path);
+  void Clear();
+
+  // Seeds the cache with the entries stored in the index at |index_path|.
+  // A missing index is not an error. An index that fails its integrity check
+  // is ignored as a whole, in which case all packages are parsed again.
+  Status LoadIndex(const std::string& index_path);
+  // Persists the entries for packages inside |dir| that are still up to date
+  // to the index at |index_path|. The file isn't rewritten if it already holds
+  // exactly these entries, as last loaded or saved by this process.
+  Status SaveIndex(const std::string& index_path, const std::string& dir);
+
+ private:
+  struct Entry {
+    FileIdentity identity;
+    ApexFile apex_file;
+  };
+
+  static bool GetFileIdentity(const std::string& path, FileIdentity* identity);
+
+  ApexFileCache() = default;
+  ApexFileCache(const ApexFileCache&) = delete;
+  ApexFileCache& operator=(const ApexFileCache&) = delete;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  // Serialized index last read from or written to each index file.
+  std::unordered_map<std::string, std::string> index_payloads_;
+};
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEX_FILE_CACHE_H_
@@ -14,17 +14,22 @@
  * limitations under the License.
  */
 
+#include <sys/stat.h>
+
 #include <string>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/scopeguard.h>
+#include <android-base/test_utils.h>
 #include <gtest/gtest.h>
 #include <libavb/libavb.h>
 #include <ziparchive/zip_archive.h>
 
 #include "apex_file.h"
+#include "apex_file_cache.h"
 #include "apex_key.h"
+#include "apexd_utils.h"
 
 static std::string testDataDir = android::base::GetExecutableDirectory() + "/";
 
@@ -89,9 +94,27 @@ TEST(ApexFileTest, VerifyApexVerity) {
   EXPECT_NE(nullptr, data.desc.get());
   EXPECT_EQ(std::string("1772301d454698dd155205b7851959c625d8a3e6"
                         "d39360122693bad804b70007"),
-            data.salt);
+            BytesToHex(data.salt));
   EXPECT_EQ(std::string("f6139829a01059be55b13e09c4fddbb5565a8626"),
-            data.root_digest);
+            BytesToHex(data.root_digest));
+}
+
+TEST(ApexFileTest, VerifyApexVerityRepeatedly) {
+  const std::string filePath = testDataDir + "apex.apexd_test.apex";
+  StatusOr<ApexFile> apexFile = ApexFile::Open(filePath);
+  ASSERT_TRUE(apexFile.Ok()) << apexFile.ErrorMessage();
+
+  auto first = apexFile->VerifyApexVerity();
+  ASSERT_TRUE(first.Ok()) << first.ErrorMessage();
+  // Later verifications of the unchanged file return the same data.
+  auto second = apexFile->VerifyApexVerity();
+  ASSERT_TRUE(second.Ok()) << second.ErrorMessage();
+
+  EXPECT_NE(first->desc.get(), second->desc.get());
+  EXPECT_EQ(0, memcmp(first->desc.get(), second->desc.get(),
+                      sizeof(AvbHashtreeDescriptor)));
+  EXPECT_EQ(first->salt, second->salt);
+  EXPECT_EQ(first->root_digest, second->root_digest);
 }
 
 // TODO: May consider packaging a debug key in debug builds (again).
@@ -137,6 +160,129 @@ TEST(ApexFileTest, GetBundledPublicKey) {
   EXPECT_EQ(keyContent, apexFile->GetBundledPublicKey());
 }
 
+TEST(ApexFileCacheTest, ReopensReplacedPackage) {
+  TemporaryDir td;
+  const std::string filePath = std::string(td.path) + "/test.apex";
+  const std::string otherPath = std::string(td.path) + "/other.apex";
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(
+      testDataDir + "apex.apexd_test.apex", &content));
+  ASSERT_TRUE(android::base::WriteStringToFile(content, filePath));
+  ASSERT_TRUE(android::base::ReadFileToString(
+      testDataDir + "apex.apexd_test_no_inst_key.apex", &content));
+  ASSERT_TRUE(android::base::WriteStringToFile(content, otherPath));
+
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  EXPECT_FALSE(cache.IsCached(filePath));
+  StatusOr<ApexFile> apexFile = cache.Open(filePath);
+  ASSERT_TRUE(apexFile.Ok()) << apexFile.ErrorMessage();
+  EXPECT_EQ("com.android.apex.test_package", apexFile->GetManifest().name());
+  EXPECT_TRUE(cache.IsCached(filePath));
+
+  // A second lookup is served from the cache and yields the same package.
+  StatusOr<ApexFile> cached = cache.Open(filePath);
+  ASSERT_TRUE(cached.Ok()) << cached.ErrorMessage();
+  EXPECT_EQ("com.android.apex.test_package", cached->GetManifest().name());
+  EXPECT_EQ(filePath, cached->GetPath());
+
+  // Replacing the file changes its identity, so the cached entry must not be
+  // returned anymore.
+  ASSERT_EQ(0, rename(otherPath.c_str(), filePath.c_str()));
+  EXPECT_FALSE(cache.IsCached(filePath));
+  StatusOr<ApexFile> replaced = cache.Open(filePath);
+  ASSERT_TRUE(replaced.Ok()) << replaced.ErrorMessage();
+  EXPECT_EQ("com.android.apex.test_package.no_inst_key",
+            replaced->GetManifest().name());
+
+  ASSERT_EQ(0, unlink(filePath.c_str()));
+  ASSERT_FALSE(cache.Open(filePath).Ok());
+}
+
+TEST(ApexFileCacheTest, IndexRoundTrip) {
+  TemporaryDir td;
+  const std::string filePath = std::string(td.path) + "/test.apex";
+  const std::string indexPath = std::string(td.path) + "/index";
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(
+      testDataDir + "apex.apexd_test.apex", &content));
+  ASSERT_TRUE(android::base::WriteStringToFile(content, filePath));
+
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  StatusOr<ApexFile> apexFile = cache.Open(filePath);
+  ASSERT_TRUE(apexFile.Ok()) << apexFile.ErrorMessage();
+
+  Status status = cache.SaveIndex(indexPath, td.path);
+  ASSERT_TRUE(status.Ok()) << status.ErrorMessage();
+
+  cache.Clear();
+  status = cache.LoadIndex(indexPath);
+  ASSERT_TRUE(status.Ok()) << status.ErrorMessage();
+
+  StatusOr<ApexFile> indexed = cache.Open(filePath);
+  ASSERT_TRUE(indexed.Ok()) << indexed.ErrorMessage();
+  EXPECT_EQ(apexFile->GetManifest().name(), indexed->GetManifest().name());
+  EXPECT_EQ(apexFile->GetManifest().version(),
+            indexed->GetManifest().version());
+  EXPECT_EQ(apexFile->GetImageOffset(), indexed->GetImageOffset());
+  EXPECT_EQ(apexFile->GetImageSize(), indexed->GetImageSize());
+  EXPECT_EQ(apexFile->GetBundledPublicKey(), indexed->GetBundledPublicKey());
+}
+
+TEST(ApexFileCacheTest, UnchangedIndexIsNotRewritten) {
+  TemporaryDir td;
+  const std::string filePath = std::string(td.path) + "/test.apex";
+  const std::string indexPath = std::string(td.path) + "/index";
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(
+      testDataDir + "apex.apexd_test.apex", &content));
+  ASSERT_TRUE(android::base::WriteStringToFile(content, filePath));
+
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  ASSERT_TRUE(cache.Open(filePath).Ok());
+  Status status = cache.SaveIndex(indexPath, td.path);
+  ASSERT_TRUE(status.Ok()) << status.ErrorMessage();
+  struct stat saved;
+  ASSERT_EQ(0, stat(indexPath.c_str(), &saved));
+
+  // The index is replaced by a rename, so a rewrite changes its inode.
+  cache.Clear();
+  ASSERT_TRUE(cache.LoadIndex(indexPath).Ok());
+  ASSERT_TRUE(cache.Open(filePath).Ok());
+  status = cache.SaveIndex(indexPath, td.path);
+  ASSERT_TRUE(status.Ok()) << status.ErrorMessage();
+  struct stat unchanged;
+  ASSERT_EQ(0, stat(indexPath.c_str(), &unchanged));
+  EXPECT_EQ(saved.st_ino, unchanged.st_ino);
+
+  ASSERT_EQ(0, unlink(filePath.c_str()));
+  status = cache.SaveIndex(indexPath, td.path);
+  ASSERT_TRUE(status.Ok()) << status.ErrorMessage();
+  struct stat rewritten;
+  ASSERT_EQ(0, stat(indexPath.c_str(), &rewritten));
+  EXPECT_NE(saved.st_ino, rewritten.st_ino);
+}
+
+TEST(ApexFileCacheTest, CorruptIndexIsRejected) {
+  TemporaryDir td;
+  const std::string indexPath = std::string(td.path) + "/index";
+
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  // A missing index is fine, it just means that nothing is known yet.
+  ASSERT_TRUE(cache.LoadIndex(indexPath).Ok());
+
+  Status status = cache.SaveIndex(indexPath, td.path);
+  ASSERT_TRUE(status.Ok()) << status.ErrorMessage();
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(indexPath, &content));
+  content.push_back('x');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, indexPath));
+  EXPECT_FALSE(cache.LoadIndex(indexPath).Ok());
+}
+
 }  // namespace
 }  // namespace apex
 }  // namespace android
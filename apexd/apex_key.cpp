@@ -18,6 +18,8 @@
 
 #include "apex_key.h"
 
+#include <algorithm>
+#include <optional>
 #include <unordered_map>
 
 #include <android-base/file.h>
@@ -25,6 +27,7 @@
 
 #include "apex_constants.h"
 #include "apex_file.h"
+#include "apex_file_cache.h"
 #include "apexd_utils.h"
 #include "status_or.h"
 #include "string_log.h"
@@ -34,6 +37,9 @@ namespace apex {
 
 namespace {
 
+// Maximum number of builtin apexes that are opened concurrently.
+static constexpr size_t kMaxKeyCollectionThreads = 4u;
+
 std::unordered_map<std::string, const std::string> gScannedApexKeys;
 
 using KeyPair = std::pair<std::string, std::string>;
@@ -57,11 +63,24 @@ StatusOr<std::vector<KeyPair>> collectEmbedddedApexKeysFromDir(
     return StatusOr<std::vector<KeyPair>>::MakeError(apex_files.ErrorStatus());
   }
 
-  for (const auto& file : *apex_files) {
-    StatusOr<ApexFile> apex_file = ApexFile::Open(file);
+  // Opening an apex that isn't cached yet parses its zip central directory,
+  // manifest and public key, so a cold cache is filled concurrently. On boot
+  // preAllocateLoopDevices() has already opened all of them. Failures are
+  // reported in the order of the files.
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  const bool cold = std::any_of(
+      apex_files->begin(), apex_files->end(),
+      [&](const std::string& path) { return !cache.IsCached(path); });
+  std::vector<std::optional<StatusOr<ApexFile>>> opened(apex_files->size());
+  ForEachInParallel(opened.size(), cold ? kMaxKeyCollectionThreads : 1,
+                    [&](size_t i) {
+                      opened[i].emplace(cache.Open((*apex_files)[i]));
+                    });
+  for (size_t i = 0; i < opened.size(); i++) {
+    StatusOr<ApexFile>& apex_file = *opened[i];
     if (!apex_file.Ok()) {
       return StatusOr<std::vector<KeyPair>>::MakeError(
-          StringLog() << "Failed to open " << file << " : "
+          StringLog() << "Failed to open " << (*apex_files)[i] << " : "
                       << apex_file.ErrorMessage());
     }
     // name of the key is the name of the apex that the key is bundled in
@@ -21,15 +21,19 @@
 
 #include "apex_database.h"
 #include "apex_file.h"
+#include "apex_file_cache.h"
 #include "apex_key.h"
 #include "apex_manifest.h"
 #include "apex_shim.h"
+#include "apexd_backend.h"
 #include "apexd_checkpoint.h"
 #include "apexd_loop.h"
 #include "apexd_prepostinstall.h"
 #include "apexd_prop.h"
 #include "apexd_session.h"
+#include "apexd_trace.h"
 #include "apexd_utils.h"
+#include "apexd_verity.h"
 #include "status_or.h"
 #include "string_log.h"
 
@@ -37,16 +41,15 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/macros.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <libavb/libavb.h>
-#include <libdm/dm.h>
-#include <libdm/dm_table.h>
-#include <libdm/dm_target.h>
 #include <selinux/android.h>
+#include <selinux/selinux.h>
 
 #include <dirent.h>
 #include <fcntl.h>
@@ -59,10 +62,12 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_map>
@@ -74,10 +79,6 @@ using android::base::ReadFullyAtOffset;
 using android::base::StartsWith;
 using android::base::StringPrintf;
 using android::base::unique_fd;
-using android::dm::DeviceMapper;
-using android::dm::DmDeviceState;
-using android::dm::DmTable;
-using android::dm::DmTargetVerity;
 
 using apex::proto::SessionState;
 
@@ -98,20 +99,48 @@ static constexpr const char* kApexVerityOnSystemProp =
 static bool gForceDmVerityOnSystem =
     android::base::GetBoolProperty(kApexVerityOnSystemProp, false);
 
-// This should be in UAPI, but it's not :-(
-static constexpr const char* kDmVerityRestartOnCorruption =
-    "restart_on_corruption";
-
 MountedApexDatabase gMountedApexes;
 
+// See setActivationBackend(). apexd can only talk to the kernel on devices.
+#ifdef __ANDROID__
+ActivationBackend* gActivationBackend = &GetKernelActivationBackend();
+#else
+ActivationBackend* gActivationBackend = nullptr;
+#endif
+
+ActivationBackend& activationBackend() {
+  CHECK(gActivationBackend != nullptr) << "No activation backend was set";
+  return *gActivationBackend;
+}
+
 CheckpointInterface* gVoldService;
 bool gSupportsFsCheckpoints = false;
 bool gInFsCheckpointMode = false;
 
+// Where a new set of active packages is assembled before it replaces
+// kActiveApexPackagesDataDir.
+static constexpr const char* kActiveApexPackagesTxnDir =
+    "/data/apex/active.txn";
+
 static constexpr size_t kLoopDeviceSetupAttempts = 3u;
 
-static const bool kUpdatable =
-    android::sysprop::ApexProperties::updatable().value_or(false);
+// Maximum number of packages that are mounted concurrently during boot.
+static constexpr size_t kMaxActivationThreads = 4u;
+
+// Number of child sessions that are verified concurrently on submission. Can
+// be overridden with kVerificationThreadsProp, up to kMaxVerificationThreads.
+static constexpr const char* kVerificationThreadsProp =
+    "persist.apexd.verification_threads";
+static constexpr size_t kDefaultVerificationThreads = 4u;
+static constexpr size_t kMaxVerificationThreads = 16u;
+
+// Read on first use, so that it can also be set on the host, which has no
+// build properties.
+bool isUpdatable() {
+  static const bool updatable =
+      android::sysprop::ApexProperties::updatable().value_or(false);
+  return updatable;
+}
 
 bool gBootstrap = false;
 static const std::vector<const std::string> kBootstrapApexes = {
@@ -136,7 +165,7 @@ Status preAllocateLoopDevices() {
 
   auto size = 0;
   for (const auto& path : *scan) {
-    auto apexFile = ApexFile::Open(path);
+    auto apexFile = ApexFileCache::GetInstance().Open(path);
     if (!apexFile.Ok() || apexFile->IsFlattened()) {
       continue;
     }
@@ -152,37 +181,37 @@ Status preAllocateLoopDevices() {
   // For devices (e.g. ARC) which doesn't support loop-control
   // preAllocateLoopDevices() can cause problem when it tries
   // to access /dev/loop-control.
-  if (size == 0 || !kUpdatable) {
+  if (size == 0 || !isUpdatable()) {
     return Status::Success();
   }
-  return loop::preAllocateLoopDevices(size);
+  return activationBackend().PreAllocateLoopDevices(size);
 }
 
-std::unique_ptr<DmTable> createVerityTable(const ApexVerityData& verity_data,
-                                           const std::string& loop,
-                                           bool restart_on_corruption) {
-  AvbHashtreeDescriptor* desc = verity_data.desc.get();
-  auto table = std::make_unique<DmTable>();
-
-  std::ostringstream hash_algorithm;
-  hash_algorithm << desc->hash_algorithm;
+// Hashtrees are stored by package id, like the packages in
+// kActiveApexPackagesDataDir.
+std::string getHashTreePath(const std::string& package_id) {
+  return StringPrintf("%s/%s", kApexHashTreeDir, package_id.c_str());
+}
 
-  auto target = std::make_unique<DmTargetVerity>(
-      0, desc->image_size / 512, desc->dm_verity_version, loop, loop,
-      desc->data_block_size, desc->hash_block_size,
-      desc->image_size / desc->data_block_size,
-      desc->tree_offset / desc->hash_block_size, hash_algorithm.str(),
-      verity_data.root_digest, verity_data.salt);
+std::string getHashTreePath(const ApexManifest& manifest) {
+  return getHashTreePath(GetPackageId(manifest));
+}
 
-  target->IgnoreZeroBlocks();
-  if (restart_on_corruption) {
-    target->SetVerityMode(kDmVerityRestartOnCorruption);
+// Generates the hashtree of |apex| ahead of its activation, if its image
+// doesn't have one.
+Status generateHashTreeIfNeeded(const ApexFile& apex) {
+  if (apex.IsFlattened()) {
+    return Status::Success();
   }
-  table->AddTarget(std::move(target));
-
-  table->set_readonly(true);
-
-  return table;
+  StatusOr<ApexVerityData> verity_data = apex.VerifyApexVerity();
+  if (!verity_data.Ok()) {
+    return verity_data.ErrorStatus();
+  }
+  if (!HasExternalHashTree(*verity_data)) {
+    return Status::Success();
+  }
+  return GenerateHashTree(apex, *verity_data,
+                          getHashTreePath(apex.GetManifest()));
 }
 
 enum WaitForDeviceMode {
@@ -190,42 +219,36 @@ enum WaitForDeviceMode {
   kWaitToBeDeleted,
 };
 
-Status waitForDevice(const std::string& device, const WaitForDeviceMode& mode) {
-  // TODO(b/122059364): Make this more efficient
-  // TODO: use std::chrono?
-
+Status waitForDevices(const std::vector<std::string>& devices,
+                      const WaitForDeviceMode& mode) {
   // Deleting a device might take more time, so wait a little bit longer.
-  size_t num_tries = mode == kWaitToBeCreated ? 10u : 15u;
+  const auto timeout = mode == kWaitToBeCreated ? 500ms : 750ms;
 
-  LOG(DEBUG) << "Waiting for " << device << " to be "
+  const std::string names = android::base::Join(devices, ", ");
+  LOG(DEBUG) << "Waiting for " << names << " to be "
              << (mode == kWaitToBeCreated ? "created" : " deleted");
-  for (size_t i = 0; i < num_tries; ++i) {
-    StatusOr<bool> status = PathExists(device);
-    if (status.Ok()) {
-      if (mode == kWaitToBeCreated && *status) {
-        return Status::Success();
-      }
-      if (mode == kWaitToBeDeleted && !*status) {
-        return Status::Success();
-      }
-    }
-    if (i + 1 < num_tries) {
-      usleep(50000);
-    }
+  Status status = activationBackend().WaitForDevices(
+      devices, /* created = */ mode == kWaitToBeCreated, timeout);
+  if (!status.Ok()) {
+    return Status::Fail(StringLog()
+                        << "Failed to wait for device " << names << " to be "
+                        << (mode == kWaitToBeCreated ? " created" : " deleted")
+                        << " : " << status.ErrorMessage());
   }
+  return Status::Success();
+}
 
-  return Status::Fail(StringLog()
-                      << "Failed to wait for device " << device << " to be "
-                      << (mode == kWaitToBeCreated ? " created" : " deleted"));
+Status waitForDevice(const std::string& device, const WaitForDeviceMode& mode) {
+  return waitForDevices({device}, mode);
 }
 
 // Deletes a dm-verity device with a given name and path.
 // Synchronizes on the device actually being deleted from userspace.
 Status DeleteVerityDevice(const std::string& name, const std::string& path) {
-  DeviceMapper& dm = DeviceMapper::Instance();
-  if (!dm.DeleteDevice(name)) {
-    return Status::Fail(StringLog() << "Failed to delete device " << name
-                                    << " with path " << path);
+  Status status = activationBackend().DeleteVerityDevice(name);
+  if (!status.Ok()) {
+    return Status::Fail(StringLog() << status.ErrorMessage() << " with path "
+                                    << path);
   }
   // Block until device is deleted from userspace.
   return waitForDevice(path, kWaitToBeDeleted);
@@ -234,13 +257,11 @@ Status DeleteVerityDevice(const std::string& name, const std::string& path) {
 // Deletes dm-verity device with a given name.
 // See function above.
 Status DeleteVerityDevice(const std::string& name) {
-  DeviceMapper& dm = DeviceMapper::Instance();
-  std::string path;
-  if (!dm.GetDmDevicePathByName(name, &path)) {
-    return Status::Fail(StringLog()
-                        << "Unable to get path for dm-verity device " << name);
+  StatusOr<std::string> path = activationBackend().GetVerityDevicePath(name);
+  if (!path.Ok()) {
+    return path.ErrorStatus();
   }
-  return DeleteVerityDevice(name, path);
+  return DeleteVerityDevice(name, *path);
 }
 
 class DmVerityDevice {
@@ -287,14 +308,19 @@ class DmVerityDevice {
   bool cleared_;
 };
 
+// |hash_device| is the same as |data_device|, unless the hashtree is external.
 StatusOr<DmVerityDevice> createVerityDevice(const std::string& name,
-                                            const DmTable& table) {
-  DeviceMapper& dm = DeviceMapper::Instance();
-
-  if (dm.GetState(name) != DmDeviceState::INVALID) {
+                                            const ApexVerityData& verity_data,
+                                            const std::string& data_device,
+                                            const std::string& hash_device,
+                                            bool restart_on_corruption) {
+  ActivationBackend& backend = activationBackend();
+
+  StatusOr<std::string> existing_path = backend.GetVerityDevicePath(name);
+  if (existing_path.Ok()) {
     // TODO: since apexd tears down devices during unmount, can this happen?
     LOG(WARNING) << "Deleting existing dm device " << name;
-    const Status& status = DeleteVerityDevice(name);
+    const Status& status = DeleteVerityDevice(name, *existing_path);
     if (!status.Ok()) {
       // TODO: should we fail instead?
       LOG(ERROR) << "Failed to delete device " << name << " : "
@@ -302,82 +328,299 @@ StatusOr<DmVerityDevice> createVerityDevice(const std::string& name,
     }
   }
 
-  if (!dm.CreateDevice(name, table)) {
-    return StatusOr<DmVerityDevice>::MakeError(
-        "Couldn't create verity device.");
+  StatusOr<std::string> dev_path =
+      backend.CreateVerityDevice(name, verity_data, data_device, hash_device,
+                                 restart_on_corruption);
+  if (!dev_path.Ok()) {
+    return StatusOr<DmVerityDevice>::MakeError(dev_path.ErrorStatus());
   }
-  DmVerityDevice dev(name);
+  return StatusOr<DmVerityDevice>(DmVerityDevice(name, *dev_path));
+}
 
-  std::string dev_path;
-  if (!dm.GetDmDevicePathByName(name, &dev_path)) {
-    return StatusOr<DmVerityDevice>::MakeError(
-        "Couldn't get verity device path!");
+// Returns the id (<name>@<version>) of the package in |path|, which is in
+// kActiveApexPackagesDataDir or kApexBackupDir. Packages are stored there as
+// <id>.apex, so the package is only opened if the path doesn't look like that.
+StatusOr<std::string> getStoredPackageId(const std::string& path) {
+  const std::string file_name = std::filesystem::path(path).filename();
+  const size_t at = file_name.rfind('@');
+  if (EndsWith(file_name, kApexPackageSuffix) && at != std::string::npos &&
+      at > 0) {
+    const std::string package_id =
+        file_name.substr(0, file_name.size() - strlen(kApexPackageSuffix));
+    int64_t version;
+    if (android::base::ParseInt(package_id.substr(at + 1), &version)) {
+      return StatusOr<std::string>(package_id);
+    }
+  }
+  StatusOr<ApexFile> apex_file = ApexFileCache::GetInstance().Open(path);
+  if (!apex_file.Ok()) {
+    return StatusOr<std::string>::MakeError(apex_file.ErrorStatus());
   }
-  dev.SetDevPath(dev_path);
+  return StatusOr<std::string>(GetPackageId(apex_file->GetManifest()));
+}
 
-  return StatusOr<DmVerityDevice>(std::move(dev));
+// Returns the name of the package in |path|, see getStoredPackageId().
+StatusOr<std::string> getStoredPackageName(const std::string& path) {
+  StatusOr<std::string> package_id = getStoredPackageId(path);
+  if (!package_id.Ok()) {
+    return package_id;
+  }
+  return StatusOr<std::string>(package_id->substr(0, package_id->rfind('@')));
 }
 
-Status RemovePreviouslyActiveApexFiles(
-    const std::unordered_set<std::string>& affected_packages,
-    const std::unordered_set<std::string>& files_to_keep) {
-  auto all_active_apex_files =
-      FindApexFilesByName(kActiveApexPackagesDataDir, false /* include_dirs */);
+// Fallback for CommitActivePackages() if directories can't be exchanged
+// atomically: the new files are linked into kActiveApexPackagesDataDir, and
+// the replaced ones are removed from it.
+Status commitActivePackagesInPlace(
+    const std::unordered_map<std::string, std::string>& new_files,
+    const std::vector<std::string>& replaced_files) {
+  // Ensure the new APEXes get removed on failure.
+  std::vector<std::string> staged_files;
+  auto scope_guard = android::base::make_scope_guard([&staged_files]() {
+    for (const std::string& staged_path : staged_files) {
+      if (TEMP_FAILURE_RETRY(unlink(staged_path.c_str())) != 0) {
+        PLOG(ERROR) << "Unable to unlink " << staged_path;
+      }
+    }
+  });
+  for (const auto& [dest_path, src_path] : new_files) {
+    if (link(src_path.c_str(), dest_path.c_str()) != 0) {
+      // TODO: Get correct binder error status.
+      return Status::Fail(PStringLog() << "Unable to link " << src_path
+                                       << " to " << dest_path);
+    }
+    staged_files.push_back(dest_path);
+  }
+  scope_guard.Disable();  // Accept the state.
 
-  if (!all_active_apex_files.Ok()) {
-    return all_active_apex_files.ErrorStatus();
+  for (const std::string& path : replaced_files) {
+    LOG(DEBUG) << "Deleting previously active apex " << path;
+    ApexFileCache::GetInstance().Invalidate(path);
+    if (unlink(path.c_str()) != 0) {
+      return Status::Fail(PStringLog() << "Failed to unlink " << path);
+    }
   }
+  return FsyncDir(kActiveApexPackagesDataDir);
+}
 
-  for (const std::string& path : *all_active_apex_files) {
-    StatusOr<ApexFile> apex_file = ApexFile::Open(path);
-    if (!apex_file.Ok()) {
-      return apex_file.ErrorStatus();
+// Gives |path| the SELinux label of |reference|. A directory created by apexd
+// is labeled after its parent, and keeps that label when it's renamed.
+Status copySelinuxLabel(const std::string& reference,
+                        const std::string& path) {
+  char* label = nullptr;
+  if (getfilecon(reference.c_str(), &label) < 0) {
+    if (errno == ENODATA || errno == ENOTSUP) {
+      // Nothing to copy, e.g. SELinux is disabled.
+      return Status::Success();
     }
+    return Status::Fail(PStringLog() << "Failed to get the label of "
+                                     << reference);
+  }
+  std::unique_ptr<char, decltype(&freecon)> label_guard(label, freecon);
+  if (setfilecon(path.c_str(), label) != 0) {
+    return Status::Fail(PStringLog() << "Failed to label " << path);
+  }
+  return Status::Success();
+}
 
-    const std::string& package_name = apex_file->GetManifest().name();
-    if (affected_packages.find(package_name) == affected_packages.end()) {
-      // This apex belongs to a package that wasn't part of this stage sessions,
-      // hence it should be kept.
+// Makes |new_files| (a map from destination path in kActiveApexPackagesDataDir
+// to the file to stage there) active, replacing all other versions of
+// |affected_packages|. The new set of active packages is assembled in a
+// separate directory, synced once, and then atomically exchanged with
+// kActiveApexPackagesDataDir, so that a crash leaves either the old or the new
+// set behind.
+Status CommitActivePackages(
+    const std::unordered_map<std::string, std::string>& new_files,
+    const std::unordered_set<std::string>& affected_packages) {
+  auto active_files = ReadDir(kActiveApexPackagesDataDir, [](const auto& e) {
+    std::error_code ec;
+    return !e.is_directory(ec);
+  });
+  if (!active_files.Ok()) {
+    return active_files.ErrorStatus();
+  }
+  std::vector<std::string> kept_files;
+  std::vector<std::string> replaced_files;
+  for (const std::string& path : *active_files) {
+    if (!EndsWith(path, kApexPackageSuffix) || new_files.count(path) != 0) {
+      kept_files.push_back(path);
       continue;
     }
+    StatusOr<std::string> package_name = getStoredPackageName(path);
+    if (!package_name.Ok()) {
+      return package_name.ErrorStatus();
+    }
+    if (affected_packages.count(*package_name) == 0) {
+      // This apex belongs to a package that wasn't part of this stage
+      // session, hence it should be kept.
+      kept_files.push_back(path);
+    } else {
+      replaced_files.push_back(path);
+    }
+  }
 
-    if (files_to_keep.find(apex_file->GetPath()) != files_to_keep.end()) {
-      // This is a path that was staged and should be kept.
-      continue;
+  // Leftover of an interrupted transaction, if any.
+  const std::string txn_dir = kActiveApexPackagesTxnDir;
+  std::error_code ec;
+  std::filesystem::remove_all(txn_dir, ec);
+  if (ec) {
+    return Status::Fail(StringLog() << "Failed to delete " << txn_dir << " : "
+                                    << ec.message());
+  }
+  auto create_status = createDirIfNeeded(txn_dir, 0750);
+  if (!create_status.Ok()) {
+    return create_status;
+  }
+  auto scope_guard = android::base::make_scope_guard([&txn_dir]() {
+    std::error_code error;
+    std::filesystem::remove_all(txn_dir, error);
+    if (error) {
+      LOG(ERROR) << "Failed to delete " << txn_dir << " : " << error.message();
     }
+  });
 
-    LOG(DEBUG) << "Deleting previously active apex " << apex_file->GetPath();
-    if (unlink(apex_file->GetPath().c_str()) != 0) {
-      return Status::Fail(PStringLog()
-                          << "Failed to unlink " << apex_file->GetPath());
+  auto txn_path = [&txn_dir](const std::string& path) {
+    return txn_dir + "/" + std::string(std::filesystem::path(path).filename());
+  };
+  for (const std::string& path : kept_files) {
+    if (link(path.c_str(), txn_path(path).c_str()) != 0) {
+      return Status::Fail(PStringLog() << "Unable to link " << path);
     }
   }
-
-  return Status::Success();
+  for (const auto& [dest_path, src_path] : new_files) {
+    if (link(src_path.c_str(), txn_path(dest_path).c_str()) != 0) {
+      // TODO: Get correct binder error status.
+      return Status::Fail(PStringLog() << "Unable to link " << src_path
+                                       << " to " << dest_path);
+    }
+    unique_fd fd(open(src_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() == -1 || fsync(fd.get()) != 0) {
+      return Status::Fail(PStringLog() << "Failed to sync " << src_path);
+    }
+    LOG(DEBUG) << "Success linking " << src_path << " to " << dest_path;
+  }
+  // |txn_dir| replaces kActiveApexPackagesDataDir, so it needs its label.
+  Status label_status = copySelinuxLabel(kActiveApexPackagesDataDir, txn_dir);
+  if (!label_status.Ok()) {
+    return label_status;
+  }
+  Status sync_status = FsyncDir(txn_dir);
+  if (!sync_status.Ok()) {
+    return sync_status;
+  }
+
+  if (!ExchangePaths(txn_dir, kActiveApexPackagesDataDir)) {
+    if (errno != ENOSYS && errno != EINVAL) {
+      return Status::Fail(PStringLog() << "Failed to exchange " << txn_dir
+                                       << " and "
+                                       << kActiveApexPackagesDataDir);
+    }
+    LOG(DEBUG) << "renameat2(RENAME_EXCHANGE) isn't supported";
+    return commitActivePackagesInPlace(new_files, replaced_files);
+  }
+  // |txn_dir| now holds the previous set, and gets deleted by |scope_guard|.
+  for (const std::string& path : replaced_files) {
+    LOG(DEBUG) << "Deleting previously active apex " << path;
+    ApexFileCache::GetInstance().Invalidate(path);
+  }
+  return FsyncDir(kApexDataDir);
+}
+
+// Reads [offset, offset + length) of |fd| in chunks of |buf_size| bytes into
+// |buffer|. Returns false and leaves errno set on failure.
+bool readVerityRange(int fd, uint64_t offset, uint64_t length, uint8_t* buffer,
+                     size_t buf_size, size_t block_size) {
+  while (length > 0) {
+    const size_t to_read = std::min<uint64_t>(length, buf_size);
+    // O_DIRECT requires the size of every read to be a multiple of the block
+    // size. Reading past the end of the device just comes back short.
+    const size_t aligned = (to_read + block_size - 1) / block_size * block_size;
+    size_t done = 0;
+    while (done < to_read) {
+      ssize_t n = TEMP_FAILURE_RETRY(
+          pread(fd, buffer + done, aligned - done, offset + done));
+      if (n <= 0) {
+        if (n == 0) {
+          errno = EIO;
+        }
+        return false;
+      }
+      done += n;
+    }
+    offset += to_read;
+    length -= to_read;
+  }
+  return true;
 }
 
-// Reads the entire device to verify the image is authenticatic
+// Reads the entire device to verify the image is authentic. Ranges of the
+// device are read in parallel with O_DIRECT, and every range that fails is
+// reported in the returned error.
 Status readVerityDevice(const std::string& verity_device,
                         uint64_t device_size) {
-  static constexpr int kBlockSize = 4096;
+  static constexpr size_t kBlockSize = 4096;
   static constexpr size_t kBufSize = 1024 * kBlockSize;
-  std::vector<uint8_t> buffer(kBufSize);
-
-  unique_fd fd(TEMP_FAILURE_RETRY(open(verity_device.c_str(), O_RDONLY)));
+  // Unit of work handed to a reader thread.
+  static constexpr uint64_t kRangeSize = 8 * kBufSize;
+  static constexpr size_t kMaxReaderThreads = 4;
+
+  android::base::Timer timer;
+  // Bypass the page cache: every block only needs to be read once to be
+  // verified, and the data isn't needed afterwards.
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(verity_device.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT)));
+  if (fd.get() == -1 && errno == EINVAL) {
+    fd.reset(TEMP_FAILURE_RETRY(
+        open(verity_device.c_str(), O_RDONLY | O_CLOEXEC)));
+  }
   if (fd.get() == -1) {
     return Status::Fail(PStringLog() << "Can't open " << verity_device);
   }
 
-  size_t bytes_left = device_size;
-  while (bytes_left > 0) {
-    size_t to_read = std::min(bytes_left, kBufSize);
-    if (!android::base::ReadFully(fd.get(), buffer.data(), to_read)) {
-      return Status::Fail(PStringLog() << "Can't verify " << verity_device
-                                       << "; corrupted?");
+  const size_t num_ranges = (device_size + kRangeSize - 1) / kRangeSize;
+  // Per-range errno, 0 if the range was read successfully.
+  std::vector<int> errors(num_ranges, 0);
+  ForEachInParallel(num_ranges, kMaxReaderThreads, [&](size_t i) {
+    void* buffer = nullptr;
+    int err = posix_memalign(&buffer, kBlockSize, kBufSize);
+    if (err != 0) {
+      errors[i] = err;
+      return;
+    }
+    auto buffer_guard =
+        android::base::make_scope_guard([buffer]() { free(buffer); });
+    const uint64_t offset = i * kRangeSize;
+    const uint64_t length = std::min(kRangeSize, device_size - offset);
+    if (!readVerityRange(fd.get(), offset, length,
+                         static_cast<uint8_t*>(buffer), kBufSize,
+                         kBlockSize)) {
+      errors[i] = errno;
     }
-    bytes_left -= to_read;
-  }
+  });
 
+  StringLog failures;
+  size_t num_failed = 0;
+  for (size_t i = 0; i < num_ranges; ++i) {
+    if (errors[i] != 0) {
+      const uint64_t offset = i * kRangeSize;
+      failures << " [" << offset << ", "
+               << std::min(offset + kRangeSize, device_size)
+               << "): " << strerror(errors[i]) << ";";
+      num_failed++;
+    }
+  }
+  if (num_failed > 0) {
+    return Status::Fail(StringLog() << "Can't verify " << verity_device
+                                    << "; corrupted? " << num_failed << " of "
+                                    << num_ranges << " ranges failed:"
+                                    << std::string(failures));
+  }
+
+  const auto elapsed_ms = timer.duration().count();
+  const uint64_t mib_per_s =
+      elapsed_ms > 0 ? device_size * 1000 / elapsed_ms / (1024 * 1024) : 0;
+  LOG(INFO) << "Verified " << device_size / 1024 << " KiB of " << verity_device
+            << " in " << elapsed_ms << " ms (" << mib_per_s << " MiB/s)";
   return Status::Success();
 }
 
@@ -393,106 +636,162 @@ Status VerifyMountedImage(const ApexFile& apex,
   return Status::Success();
 }
 
-StatusOr<MountedApexData> mountNonFlattened(const ApexFile& apex,
-                                            const std::string& mountPoint,
-                                            const std::string& device_name,
-                                            bool verifyImage) {
-  using StatusM = StatusOr<MountedApexData>;
+// A non-flattened APEX whose loop and dm-verity devices have been created, but
+// which isn't mounted yet. The devices are torn down again if it's destroyed
+// before finishNonFlattenedMount() accepted them.
+struct PreparedMount {
+  loop::LoopbackDeviceUniqueFd loopbackDevice;
+  // Only set up if the hashtree is external.
+  loop::LoopbackDeviceUniqueFd hashTreeLoopbackDevice;
+  DmVerityDevice verityDev;
+  ApexVerityData verityData;
+  std::string blockDevice;
+  bool mountOnVerity = false;
+};
+
+StatusOr<PreparedMount> prepareNonFlattenedMount(const ApexFile& apex,
+                                                 const std::string& device_name,
+                                                 bool verifyImage) {
+  using StatusM = StatusOr<PreparedMount>;
   const std::string& full_path = apex.GetPath();
 
-  if (!kUpdatable) {
+  if (!isUpdatable()) {
     return StatusM::Fail(StringLog()
                          << "Unable to mount non-flattened apex package "
                          << full_path << " because device doesn't support it");
   }
 
-  loop::LoopbackDeviceUniqueFd loopbackDevice;
-  for (size_t attempts = 1;; ++attempts) {
-    StatusOr<loop::LoopbackDeviceUniqueFd> ret = loop::createLoopDevice(
-        full_path, apex.GetImageOffset(), apex.GetImageSize());
-    if (ret.Ok()) {
-      loopbackDevice = std::move(*ret);
-      break;
-    }
-    if (attempts >= kLoopDeviceSetupAttempts) {
-      return StatusM::Fail(StringLog()
-                           << "Could not create loop device for " << full_path
-                           << ": " << ret.ErrorMessage());
+  PreparedMount prepared;
+  {
+    trace::ScopedPhase phase(trace::Phase::kLoopSetup, full_path);
+    for (size_t attempts = 1;; ++attempts) {
+      StatusOr<loop::LoopbackDeviceUniqueFd> ret =
+          activationBackend().CreateLoopDevice(
+              full_path, apex.GetImageOffset(), apex.GetImageSize());
+      if (ret.Ok()) {
+        prepared.loopbackDevice = std::move(*ret);
+        break;
+      }
+      if (attempts >= kLoopDeviceSetupAttempts) {
+        return StatusM::Fail(StringLog()
+                             << "Could not create loop device for "
+                             << full_path << ": " << ret.ErrorMessage());
+      }
     }
   }
-  LOG(VERBOSE) << "Loopback device created: " << loopbackDevice.name;
+  LOG(VERBOSE) << "Loopback device created: " << prepared.loopbackDevice.name;
 
-  auto verityData = apex.VerifyApexVerity();
-  if (!verityData.Ok()) {
-    return StatusM::Fail(StringLog()
-                         << "Failed to verify Apex Verity data for "
-                         << full_path << ": " << verityData.ErrorMessage());
+  {
+    trace::ScopedPhase phase(trace::Phase::kVerify, full_path);
+    auto verityData = apex.VerifyApexVerity();
+    if (!verityData.Ok()) {
+      return StatusM::Fail(StringLog()
+                           << "Failed to verify Apex Verity data for "
+                           << full_path << ": " << verityData.ErrorMessage());
+    }
+    prepared.verityData = std::move(*verityData);
   }
-  std::string blockDevice = loopbackDevice.name;
-  MountedApexData apex_data(loopbackDevice.name, apex.GetPath(), mountPoint,
-                            device_name);
+  prepared.blockDevice = prepared.loopbackDevice.name;
 
   // for APEXes in immutable partitions, we don't need to mount them on
   // dm-verity because they are already in the dm-verity protected partition;
   // system. However, note that we don't skip verification to ensure that APEXes
   // are correctly signed.
-  const bool mountOnVerity =
+  prepared.mountOnVerity =
       gForceDmVerityOnSystem || !isPathForBuiltinApexes(full_path);
-  DmVerityDevice verityDev;
-  if (mountOnVerity) {
-    auto verityTable =
-        createVerityTable(*verityData, loopbackDevice.name,
-                          /* restart_on_corruption = */ !verifyImage);
-    StatusOr<DmVerityDevice> verityDevRes =
-        createVerityDevice(device_name, *verityTable);
+  if (prepared.mountOnVerity && HasExternalHashTree(prepared.verityData)) {
+    const std::string hashTreePath = getHashTreePath(apex.GetManifest());
+    {
+      trace::ScopedPhase phase(trace::Phase::kVerify, full_path);
+      // dm-verity would reject a stale hashtree on first read, checking it
+      // here fails the activation early instead.
+      Status status = VerifyHashTree(prepared.verityData, hashTreePath);
+      if (!status.Ok()) {
+        return StatusM::Fail(StringLog()
+                             << "Invalid hashtree of " << full_path << ": "
+                             << status.ErrorMessage());
+      }
+    }
+    trace::ScopedPhase phase(trace::Phase::kLoopSetup, full_path);
+    StatusOr<loop::LoopbackDeviceUniqueFd> ret =
+        activationBackend().CreateLoopDevice(hashTreePath, 0, 0);
+    if (!ret.Ok()) {
+      return StatusM::Fail(StringLog()
+                           << "Could not create loop device for hashtree "
+                           << hashTreePath << " of " << full_path << ": "
+                           << ret.ErrorMessage());
+    }
+    prepared.hashTreeLoopbackDevice = std::move(*ret);
+    LOG(VERBOSE) << "Loopback device created for hashtree: "
+                 << prepared.hashTreeLoopbackDevice.name;
+  }
+
+  if (prepared.mountOnVerity) {
+    trace::ScopedPhase phase(trace::Phase::kDmCreate, full_path);
+    const std::string& hashDevice =
+        HasExternalHashTree(prepared.verityData)
+            ? prepared.hashTreeLoopbackDevice.name
+            : prepared.loopbackDevice.name;
+    StatusOr<DmVerityDevice> verityDevRes = createVerityDevice(
+        device_name, prepared.verityData, prepared.loopbackDevice.name,
+        hashDevice, /* restart_on_corruption = */ !verifyImage);
     if (!verityDevRes.Ok()) {
       return StatusM::Fail(StringLog()
                            << "Failed to create Apex Verity device "
                            << full_path << ": " << verityDevRes.ErrorMessage());
     }
-    verityDev = std::move(*verityDevRes);
-    blockDevice = verityDev.GetDevPath();
+    prepared.verityDev = std::move(*verityDevRes);
+    prepared.blockDevice = prepared.verityDev.GetDevPath();
 
-    Status readAheadStatus = loop::configureReadAhead(verityDev.GetDevPath());
+    Status readAheadStatus = activationBackend().ConfigureReadAhead(
+        prepared.verityDev.GetDevPath());
     if (!readAheadStatus.Ok()) {
       return StatusM::MakeError(readAheadStatus);
     }
   }
+  return StatusM(std::move(prepared));
+}
 
-  // TODO(b/122059364): Even though the kernel has created the verity
-  // device, we still depend on ueventd to run to actually create the
-  // device node in userspace. To solve this properly we should listen on
-  // the netlink socket for uevents, or use inotify. For now, this will
-  // have to do.
-  Status deviceStatus = waitForDevice(blockDevice, kWaitToBeCreated);
-  if (!deviceStatus.Ok()) {
-    return StatusM::MakeError(deviceStatus);
-  }
+// Mounts a prepared APEX. The block device must already exist in userspace.
+StatusOr<MountedApexData> finishNonFlattenedMount(const ApexFile& apex,
+                                                  PreparedMount& prepared,
+                                                  const std::string& mountPoint,
+                                                  const std::string& device_name,
+                                                  bool verifyImage) {
+  using StatusM = StatusOr<MountedApexData>;
+  const std::string& full_path = apex.GetPath();
+  const std::string& blockDevice = prepared.blockDevice;
+  MountedApexData apex_data(prepared.loopbackDevice.name, apex.GetPath(),
+                            mountPoint, device_name);
+  apex_data.hashtree_loop_name = prepared.hashTreeLoopbackDevice.name;
 
   // TODO: consider moving this inside RunVerifyFnInsideTempMount.
-  if (mountOnVerity && verifyImage) {
+  if (prepared.mountOnVerity && verifyImage) {
     Status verityStatus =
-        readVerityDevice(blockDevice, (*verityData).desc->image_size);
+        readVerityDevice(blockDevice, prepared.verityData.desc->image_size);
     if (!verityStatus.Ok()) {
       return StatusM::MakeError(verityStatus);
     }
   }
 
-  if (mount(blockDevice.c_str(), mountPoint.c_str(), "ext4",
-            MS_NOATIME | MS_NODEV | MS_DIRSYNC | MS_RDONLY, nullptr) == 0) {
+  trace::ScopedPhase phase(trace::Phase::kMount, full_path);
+  ActivationBackend& backend = activationBackend();
+  if (backend.Mount(blockDevice, mountPoint, "ext4",
+                    MS_NOATIME | MS_NODEV | MS_DIRSYNC | MS_RDONLY) == 0) {
     LOG(INFO) << "Successfully mounted package " << full_path << " on "
               << mountPoint;
     auto status = VerifyMountedImage(apex, mountPoint);
     if (!status.Ok()) {
-      umount2(mountPoint.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH);
+      backend.Unmount(mountPoint);
       return StatusM::Fail(StringLog() << "Failed to verify " << full_path
                                        << ": " << status.ErrorMessage());
     }
     // Time to accept the temporaries as good.
-    if (mountOnVerity) {
-      verityDev.Release();
+    if (prepared.mountOnVerity) {
+      prepared.verityDev.Release();
     }
-    loopbackDevice.CloseGood();
+    prepared.loopbackDevice.CloseGood();
+    prepared.hashTreeLoopbackDevice.CloseGood();
 
     return StatusM(std::move(apex_data));
   } else {
@@ -501,6 +800,31 @@ StatusOr<MountedApexData> mountNonFlattened(const ApexFile& apex,
   }
 }
 
+StatusOr<MountedApexData> mountNonFlattened(const ApexFile& apex,
+                                            const std::string& mountPoint,
+                                            const std::string& device_name,
+                                            bool verifyImage) {
+  using StatusM = StatusOr<MountedApexData>;
+  StatusOr<PreparedMount> prepared =
+      prepareNonFlattenedMount(apex, device_name, verifyImage);
+  if (!prepared.Ok()) {
+    return StatusM::MakeError(prepared.ErrorStatus());
+  }
+
+  {
+    // Even though the kernel has created the verity device, we still depend
+    // on ueventd to run to actually create the device node in userspace.
+    trace::ScopedPhase phase(trace::Phase::kDeviceWait, apex.GetPath());
+    Status deviceStatus =
+        waitForDevice(prepared->blockDevice, kWaitToBeCreated);
+    if (!deviceStatus.Ok()) {
+      return StatusM::MakeError(deviceStatus);
+    }
+  }
+  return finishNonFlattenedMount(apex, *prepared, mountPoint, device_name,
+                                 verifyImage);
+}
+
 StatusOr<MountedApexData> mountFlattened(const ApexFile& apex,
                                          const std::string& mountPoint) {
   using StatusM = StatusOr<MountedApexData>;
@@ -509,8 +833,9 @@ StatusOr<MountedApexData> mountFlattened(const ApexFile& apex,
                                      << apex.GetPath());
   }
 
-  if (mount(apex.GetPath().c_str(), mountPoint.c_str(), nullptr, MS_BIND,
-            nullptr) == 0) {
+  trace::ScopedPhase phase(trace::Phase::kMount, apex.GetPath());
+  if (activationBackend().Mount(apex.GetPath(), mountPoint, nullptr,
+                               MS_BIND) == 0) {
     LOG(INFO) << "Successfully bind-mounted flattened package "
               << apex.GetPath() << " on " << mountPoint;
 
@@ -522,11 +847,13 @@ StatusOr<MountedApexData> mountFlattened(const ApexFile& apex,
                                     << apex.GetPath());
 }
 
-StatusOr<MountedApexData> MountPackageImpl(const ApexFile& apex,
-                                           const std::string& mountPoint,
-                                           const std::string& device_name,
-                                           bool verifyImage) {
-  using StatusM = StatusOr<MountedApexData>;
+void removeMountPoint(const std::string& mountPoint) {
+  if (rmdir(mountPoint.c_str()) != 0) {
+    PLOG(WARNING) << "Could not rmdir " << mountPoint;
+  }
+}
+
+Status createMountPoint(const std::string& mountPoint) {
   LOG(VERBOSE) << "Creating mount point: " << mountPoint;
   // Note: the mount point could exist in case when the APEX was activated
   // during the bootstrap phase (e.g., the runtime or tzdata APEX).
@@ -538,21 +865,31 @@ StatusOr<MountedApexData> MountPackageImpl(const ApexFile& apex,
   // it.
   auto exists = PathExists(mountPoint);
   if (!exists.Ok()) {
-    return StatusM::MakeError(exists.ErrorStatus());
+    return exists.ErrorStatus();
   }
   if (!*exists && mkdir(mountPoint.c_str(), kMkdirMode) != 0) {
-    return StatusM::Fail(PStringLog()
-                         << "Could not create mount point " << mountPoint);
+    return Status::Fail(PStringLog()
+                        << "Could not create mount point " << mountPoint);
   }
-  auto deleter = [&mountPoint]() {
-    if (rmdir(mountPoint.c_str()) != 0) {
-      PLOG(WARNING) << "Could not rmdir " << mountPoint;
-    }
-  };
-  auto scope_guard = android::base::make_scope_guard(deleter);
   if (!IsEmptyDirectory(mountPoint)) {
-    return StatusM::Fail(PStringLog() << mountPoint << " is not empty");
+    Status status = Status::Fail(PStringLog() << mountPoint << " is not empty");
+    removeMountPoint(mountPoint);
+    return status;
   }
+  return Status::Success();
+}
+
+StatusOr<MountedApexData> MountPackageImpl(const ApexFile& apex,
+                                           const std::string& mountPoint,
+                                           const std::string& device_name,
+                                           bool verifyImage) {
+  using StatusM = StatusOr<MountedApexData>;
+  Status mountPointStatus = createMountPoint(mountPoint);
+  if (!mountPointStatus.Ok()) {
+    return StatusM::MakeError(mountPointStatus);
+  }
+  auto scope_guard = android::base::make_scope_guard(
+      [&mountPoint]() { removeMountPoint(mountPoint); });
 
   StatusOr<MountedApexData> ret;
   if (apex.IsFlattened()) {
@@ -575,10 +912,20 @@ StatusOr<MountedApexData> VerifyAndTempMountPackage(
                           /* verifyImage = */ true);
 }
 
+// Returns the metadata recorded for a mounted package, only falling back to
+// reading the apex file if none was recorded.
+StatusOr<ApexFile> getMountedApexFile(const MountedApexData& data) {
+  if (data.apex_file != nullptr) {
+    return StatusOr<ApexFile>(*data.apex_file);
+  }
+  return ApexFileCache::GetInstance().Open(data.full_path);
+}
+
 Status Unmount(const MountedApexData& data) {
   // Lazily try to umount whatever is mounted.
-  if (umount2(data.mount_point.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0 &&
-      errno != EINVAL && errno != ENOENT) {
+  ActivationBackend& backend = activationBackend();
+  if (backend.Unmount(data.mount_point) != 0 && errno != EINVAL &&
+      errno != ENOENT) {
     return Status::Fail(PStringLog()
                         << "Failed to unmount directory " << data.mount_point);
   }
@@ -597,13 +944,16 @@ Status Unmount(const MountedApexData& data) {
     }
   }
 
-  // Try to free up the loop device.
+  // Try to free up the loop devices.
+  auto log_fn = [](const std::string& path,
+                   const std::string& id ATTRIBUTE_UNUSED) {
+    LOG(VERBOSE) << "Freeing loop device " << path << "for unmount.";
+  };
   if (!data.loop_name.empty()) {
-    auto log_fn = [](const std::string& path,
-                     const std::string& id ATTRIBUTE_UNUSED) {
-      LOG(VERBOSE) << "Freeing loop device " << path << "for unmount.";
-    };
-    loop::DestroyLoopDevice(data.loop_name, log_fn);
+    backend.DestroyLoopDevice(data.loop_name, log_fn);
+  }
+  if (!data.hashtree_loop_name.empty()) {
+    backend.DestroyLoopDevice(data.hashtree_loop_name, log_fn);
   }
 
   return Status::Success();
@@ -741,13 +1091,17 @@ Status VerifyPackageInstall(const ApexFile& apex_file) {
   if (!verify_package_boot_status.Ok()) {
     return verify_package_boot_status;
   }
-  if (!kUpdatable) {
+  if (!isUpdatable()) {
     return Status::Fail(StringLog() << "Attempted to upgrade apex package "
                                     << apex_file.GetPath()
                                     << " on a device that doesn't support it");
   }
-  StatusOr<ApexVerityData> verity_or = apex_file.VerifyApexVerity();
-
+  // The session is staged once it's verified, and mounting the package below
+  // needs its hashtree.
+  Status status = generateHashTreeIfNeeded(apex_file);
+  if (!status.Ok()) {
+    return status;
+  }
   constexpr const auto kSuccessFn = [](const std::string& _) {
     return Status::Success();
   };
@@ -775,7 +1129,9 @@ StatusOr<std::vector<ApexFile>> verifyPackages(
   return HandlePackages<StatusT>(paths, verify_fn);
 }
 
-StatusOr<ApexFile> verifySessionDir(const int session_id) {
+// Returns the paths of the packages staged for |session_id|, of which there
+// must be at most one.
+StatusOr<std::vector<std::string>> scanSessionDir(const int session_id) {
   std::string sessionDirPath = std::string(kStagedSessionsDir) + "/session_" +
                                std::to_string(session_id);
   LOG(INFO) << "Scanning " << sessionDirPath
@@ -784,13 +1140,21 @@ StatusOr<ApexFile> verifySessionDir(const int session_id) {
       FindApexFilesByName(sessionDirPath, /* include_dirs=*/false);
   if (!scan.Ok()) {
     LOG(WARNING) << scan.ErrorMessage();
-    return StatusOr<ApexFile>::MakeError(scan.ErrorMessage());
+    return scan;
   }
 
   if (scan->size() > 1) {
-    return StatusOr<ApexFile>::MakeError(
+    return StatusOr<std::vector<std::string>>::MakeError(
         "More than one APEX package found in the same session directory.");
   }
+  return scan;
+}
+
+StatusOr<ApexFile> verifySessionDir(const int session_id) {
+  StatusOr<std::vector<std::string>> scan = scanSessionDir(session_id);
+  if (!scan.Ok()) {
+    return StatusOr<ApexFile>::MakeError(scan.ErrorMessage());
+  }
 
   auto verified = verifyPackages(*scan, VerifyPackageInstall);
   if (!verified.Ok()) {
@@ -799,6 +1163,32 @@ StatusOr<ApexFile> verifySessionDir(const int session_id) {
   return StatusOr<ApexFile>(std::move((*verified)[0]));
 }
 
+// Fails if two of |session_ids| stage the same package. They would be temp
+// mounted on the same mount point and dm device when verified concurrently.
+// Sessions whose package can't be read are left for verifySessionDir() to
+// report.
+Status checkNoDuplicatePackages(const std::vector<int>& session_ids) {
+  std::unordered_map<std::string, int> sessions_by_package;
+  for (int session_id : session_ids) {
+    StatusOr<std::vector<std::string>> scan = scanSessionDir(session_id);
+    if (!scan.Ok() || scan->empty()) {
+      continue;
+    }
+    StatusOr<ApexFile> apex = ApexFileCache::GetInstance().Open((*scan)[0]);
+    if (!apex.Ok()) {
+      continue;
+    }
+    const std::string& name = apex->GetManifest().name();
+    auto [it, inserted] = sessions_by_package.emplace(name, session_id);
+    if (!inserted) {
+      return Status::Fail(StringLog()
+                          << "Package " << name << " is staged by both session "
+                          << it->second << " and session " << session_id);
+    }
+  }
+  return Status::Success();
+}
+
 Status ClearSessions() {
   auto sessions = ApexSession::GetSessions();
   int cnt = 0;
@@ -828,6 +1218,9 @@ Status DeleteBackup() {
   return DeleteDirContent(std::string(kApexBackupDir));
 }
 
+// Makes kApexBackupDir hold the same packages as kActiveApexPackagesDataDir.
+// Usually most of them are backed up already, so only the differences are
+// applied.
 Status BackupActivePackages() {
   LOG(DEBUG) << "Initializing  backup of " << kActiveApexPackagesDataDir;
 
@@ -854,19 +1247,12 @@ Status BackupActivePackages() {
     return Status::Fail(StringLog() << "Backup failed : "
                                     << active_packages.ErrorMessage());
   }
-
-  auto cleanup_status = DeleteBackup();
-  if (!cleanup_status.Ok()) {
+  auto backup_files = ReadDir(kApexBackupDir, [](auto _) { return true; });
+  if (!backup_files.Ok()) {
     return Status::Fail(StringLog()
-                        << "Backup failed : " << cleanup_status.ErrorMessage());
+                        << "Backup failed : " << backup_files.ErrorMessage());
   }
 
-  auto backup_path_fn = [](const ApexFile& apex_file) {
-    return StringPrintf("%s/%s%s", kApexBackupDir,
-                        GetPackageId(apex_file.GetManifest()).c_str(),
-                        kApexPackageSuffix);
-  };
-
   auto deleter = []() {
     auto status = DeleteDirContent(std::string(kApexBackupDir));
     if (!status.Ok()) {
@@ -876,17 +1262,50 @@ Status BackupActivePackages() {
   };
   auto scope_guard = android::base::make_scope_guard(deleter);
 
+  // Backup files are hard links, so a package is backed up already if the
+  // backup path refers to the same inode.
+  auto same_file = [](const std::string& a, const std::string& b) {
+    struct stat a_stat, b_stat;
+    return stat(a.c_str(), &a_stat) == 0 && stat(b.c_str(), &b_stat) == 0 &&
+           a_stat.st_dev == b_stat.st_dev && a_stat.st_ino == b_stat.st_ino;
+  };
+  std::unordered_set<std::string> backed_up;
+  size_t num_linked = 0;
   for (const std::string& path : *active_packages) {
-    StatusOr<ApexFile> apex_file = ApexFile::Open(path);
-    if (!apex_file.Ok()) {
-      return Status::Fail("Backup failed : " + apex_file.ErrorMessage());
+    StatusOr<std::string> package_id = getStoredPackageId(path);
+    if (!package_id.Ok()) {
+      return Status::Fail("Backup failed : " + package_id.ErrorMessage());
+    }
+    const std::string dest_path = StringPrintf(
+        "%s/%s%s", kApexBackupDir, package_id->c_str(), kApexPackageSuffix);
+    backed_up.insert(dest_path);
+    if (same_file(path, dest_path)) {
+      continue;
     }
-    const auto& dest_path = backup_path_fn(*apex_file);
-    if (link(apex_file->GetPath().c_str(), dest_path.c_str()) != 0) {
-      return Status::Fail(PStringLog()
-                          << "Failed to backup " << apex_file->GetPath());
+    if (unlink(dest_path.c_str()) != 0 && errno != ENOENT) {
+      return Status::Fail(PStringLog() << "Failed to delete " << dest_path);
+    }
+    if (link(path.c_str(), dest_path.c_str()) != 0) {
+      return Status::Fail(PStringLog() << "Failed to backup " << path);
     }
+    num_linked++;
   }
+  size_t num_deleted = 0;
+  for (const std::string& path : *backup_files) {
+    if (backed_up.count(path) != 0) {
+      continue;
+    }
+    if (unlink(path.c_str()) != 0) {
+      return Status::Fail(PStringLog() << "Failed to delete " << path);
+    }
+    num_deleted++;
+  }
+  auto sync_status = FsyncDir(kApexBackupDir);
+  if (!sync_status.Ok()) {
+    return Status::Fail("Backup failed : " + sync_status.ErrorMessage());
+  }
+  LOG(DEBUG) << "Backed up " << num_linked << " packages, deleted "
+             << num_deleted << " old backups";
 
   scope_guard.Disable();  // Accept the backup.
   return Status::Success();
@@ -920,18 +1339,37 @@ Status DoRollback(ApexSession& session) {
                         << "Failed to access " << kActiveApexPackagesDataDir);
   }
 
-  LOG(DEBUG) << "Deleting existing packages in " << kActiveApexPackagesDataDir;
-  auto delete_status =
-      DeleteDirContent(std::string(kActiveApexPackagesDataDir));
-  if (!delete_status.Ok()) {
-    return delete_status;
-  }
-
-  LOG(DEBUG) << "Renaming " << kApexBackupDir << " to "
+  LOG(DEBUG) << "Exchanging " << kApexBackupDir << " and "
              << kActiveApexPackagesDataDir;
-  if (rename(kApexBackupDir, kActiveApexPackagesDataDir) != 0) {
-    return Status::Fail(PStringLog() << "Failed to rename " << kApexBackupDir
-                                     << " to " << kActiveApexPackagesDataDir);
+  if (ExchangePaths(kApexBackupDir, kActiveApexPackagesDataDir)) {
+    // The backup directory now holds the packages that were rolled back.
+    std::error_code ec;
+    std::filesystem::remove_all(kApexBackupDir, ec);
+    if (ec) {
+      LOG(WARNING) << "Failed to delete " << kApexBackupDir << " : "
+                   << ec.message();
+    }
+  } else {
+    if (errno != ENOSYS && errno != EINVAL) {
+      return Status::Fail(PStringLog()
+                          << "Failed to exchange " << kApexBackupDir << " and "
+                          << kActiveApexPackagesDataDir);
+    }
+    LOG(DEBUG) << "Deleting existing packages in "
+               << kActiveApexPackagesDataDir;
+    auto delete_status =
+        DeleteDirContent(std::string(kActiveApexPackagesDataDir));
+    if (!delete_status.Ok()) {
+      return delete_status;
+    }
+
+    LOG(DEBUG) << "Renaming " << kApexBackupDir << " to "
+               << kActiveApexPackagesDataDir;
+    if (rename(kApexBackupDir, kActiveApexPackagesDataDir) != 0) {
+      return Status::Fail(PStringLog()
+                          << "Failed to rename " << kApexBackupDir << " to "
+                          << kActiveApexPackagesDataDir);
+    }
   }
 
   LOG(DEBUG) << "Restoring original permissions for "
@@ -942,6 +1380,10 @@ Status DoRollback(ApexSession& session) {
                         << "Failed to restore original permissions for "
                         << kActiveApexPackagesDataDir);
   }
+  auto sync_status = FsyncDir(kApexDataDir);
+  if (!sync_status.Ok()) {
+    return sync_status;
+  }
 
   scope_guard.Disable();  // Rollback succeeded. Accept state.
   return Status::Success();
@@ -1049,7 +1491,7 @@ Status UnmountPackage(const ApexFile& apex, bool allow_latest) {
     }
     std::string mount_point = apexd_private::GetActiveMountPoint(manifest);
     LOG(VERBOSE) << "Unmounting and deleting " << mount_point;
-    if (umount2(mount_point.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0) {
+    if (activationBackend().Unmount(mount_point) != 0) {
       return Status::Fail(PStringLog() << "Failed to unmount " << mount_point);
     }
     if (rmdir(mount_point.c_str()) != 0) {
@@ -1075,6 +1517,7 @@ Status MountPackage(const ApexFile& apex, const std::string& mountPoint) {
     return ret.ErrorStatus();
   }
 
+  ret->apex_file = std::make_shared<const ApexFile>(apex);
   gMountedApexes.AddMountedApex(apex.GetManifest().name(), false,
                                 std::move(*ret));
   return Status::Success();
@@ -1096,15 +1539,25 @@ bool IsMounted(const std::string& name, const std::string& full_path) {
 }
 
 std::string GetPackageMountPoint(const ApexManifest& manifest) {
-  return StringPrintf("%s/%s", kApexRoot, GetPackageId(manifest).c_str());
+  return StringPrintf("%s/%s", activationBackend().GetMountRoot().c_str(),
+                      GetPackageId(manifest).c_str());
 }
 
 std::string GetActiveMountPoint(const ApexManifest& manifest) {
-  return StringPrintf("%s/%s", kApexRoot, manifest.name().c_str());
+  return StringPrintf("%s/%s", activationBackend().GetMountRoot().c_str(),
+                      manifest.name().c_str());
 }
 
+ActivationBackend& GetActivationBackend() { return activationBackend(); }
+
+void ForgetMountedApexes() { gMountedApexes.Clear(); }
+
 }  // namespace apexd_private
 
+void setActivationBackend(ActivationBackend* backend) {
+  gActivationBackend = backend;
+}
+
 Status resumeRollbackIfNeeded() {
   auto session = ApexSession::GetActiveSession();
   if (!session.Ok()) {
@@ -1120,72 +1573,65 @@ Status resumeRollbackIfNeeded() {
   return Status::Success();
 }
 
-Status activatePackageImpl(const ApexFile& apex_file) {
-  const ApexManifest& manifest = apex_file.GetManifest();
+namespace {
 
+// Returns true if |apex_file| shouldn't be activated in the current boot phase.
+bool skipActivationInCurrentPhase(const ApexFile& apex_file) {
   if (gBootstrap && !isBootstrapApex(apex_file)) {
     LOG(INFO) << "Skipped when bootstrapping";
-    return Status::Success();
-  } else if (!kUpdatable && !gBootstrap && isBootstrapApex(apex_file)) {
+    return true;
+  } else if (!isUpdatable() && !gBootstrap && isBootstrapApex(apex_file)) {
     LOG(INFO) << "Package already activated in bootstrap";
-    return Status::Success();
+    return true;
   }
+  return false;
+}
 
-  // See whether we think it's active, and do not allow to activate the same
-  // version. Also detect whether this is the highest version.
-  // We roll this into a single check.
+// How a package relates to the versions of it that are already mounted.
+struct MountedVersionInfo {
   bool is_newest_version = true;
-  bool found_other_version = false;
   bool version_found_mounted = false;
-  {
-    uint64_t new_version = manifest.version();
-    bool version_found_active = false;
-    gMountedApexes.ForallMountedApexes(
-        manifest.name(), [&](const MountedApexData& data, bool latest) {
-          StatusOr<ApexFile> otherApex = ApexFile::Open(data.full_path);
-          if (!otherApex.Ok()) {
-            return;
-          }
-          found_other_version = true;
-          if (static_cast<uint64_t>(otherApex->GetManifest().version()) ==
-              new_version) {
-            version_found_mounted = true;
-            version_found_active = latest;
-          }
-          if (static_cast<uint64_t>(otherApex->GetManifest().version()) >
-              new_version) {
-            is_newest_version = false;
-          }
-        });
-    if (version_found_active) {
-      LOG(DEBUG) << "Package " << manifest.name() << " with version "
-                 << manifest.version() << " already active";
-      return Status::Success();
-    }
-  }
-
-  const std::string& mountPoint = apexd_private::GetPackageMountPoint(manifest);
+  bool version_found_active = false;
+};
 
-  if (!version_found_mounted) {
-    Status mountStatus = apexd_private::MountPackage(apex_file, mountPoint);
-    if (!mountStatus.Ok()) {
-      return mountStatus;
-    }
-  }
+MountedVersionInfo getMountedVersionInfo(const ApexManifest& manifest) {
+  MountedVersionInfo info;
+  uint64_t new_version = manifest.version();
+  gMountedApexes.ForallMountedApexes(
+      manifest.name(), [&](const MountedApexData& data, bool latest) {
+        StatusOr<ApexFile> otherApex = getMountedApexFile(data);
+        if (!otherApex.Ok()) {
+          return;
+        }
+        if (static_cast<uint64_t>(otherApex->GetManifest().version()) ==
+            new_version) {
+          info.version_found_mounted = true;
+          info.version_found_active = latest;
+        }
+        if (static_cast<uint64_t>(otherApex->GetManifest().version()) >
+            new_version) {
+          info.is_newest_version = false;
+        }
+      });
+  return info;
+}
 
-  bool mounted_latest = false;
+// Makes an already mounted package visible under /apex/<name>, if it is the
+// newest mounted version of that package.
+Status activateMountedPackage(const ApexFile& apex_file,
+                              bool is_newest_version) {
+  const ApexManifest& manifest = apex_file.GetManifest();
   if (is_newest_version) {
-    const Status& update_st = apexd_private::BindMount(
-        apexd_private::GetActiveMountPoint(manifest), mountPoint);
-    mounted_latest = update_st.Ok();
+    trace::ScopedPhase phase(trace::Phase::kBindMount, apex_file.GetPath());
+    const std::string target = apexd_private::GetActiveMountPoint(manifest);
+    const std::string source = apexd_private::GetPackageMountPoint(manifest);
+    const Status& update_st = apexd_private::BindMount(target, source);
     if (!update_st.Ok()) {
       return Status::Fail(StringLog()
                           << "Failed to update package " << manifest.name()
                           << " to version " << manifest.version() << " : "
                           << update_st.ErrorMessage());
     }
-  }
-  if (mounted_latest) {
     gMountedApexes.SetLatest(manifest.name(), apex_file.GetPath());
   }
 
@@ -1195,10 +1641,194 @@ Status activatePackageImpl(const ApexFile& apex_file) {
   return Status::Success();
 }
 
+}  // namespace
+
+Status activatePackageImpl(const ApexFile& apex_file) {
+  const ApexManifest& manifest = apex_file.GetManifest();
+
+  if (skipActivationInCurrentPhase(apex_file)) {
+    return Status::Success();
+  }
+
+  // See whether we think it's active, and do not allow to activate the same
+  // version. Also detect whether this is the highest version.
+  // We roll this into a single check.
+  MountedVersionInfo info = getMountedVersionInfo(manifest);
+  if (info.version_found_active) {
+    LOG(DEBUG) << "Package " << manifest.name() << " with version "
+               << manifest.version() << " already active";
+    return Status::Success();
+  }
+
+  if (!info.version_found_mounted) {
+    Status mountStatus = apexd_private::MountPackage(
+        apex_file, apexd_private::GetPackageMountPoint(manifest));
+    if (!mountStatus.Ok()) {
+      return mountStatus;
+    }
+  }
+
+  return activateMountedPackage(apex_file, info.is_newest_version);
+}
+
+namespace {
+
+// Activates |apexes|, mounting them concurrently on at most
+// kMaxActivationThreads threads. Updates of gMountedApexes and of the
+// /apex/<name> bind-mounts are done afterwards on the calling thread, in the
+// order of |apexes|, so that the outcome doesn't depend on scheduling.
+// Returns the activation status of each package, in the order of |apexes|.
+std::vector<Status> activatePackagesInParallel(
+    const std::vector<ApexFile>& apexes) {
+  const size_t count = apexes.size();
+  std::vector<Status> results(count);
+  std::vector<MountedVersionInfo> infos(count);
+  std::vector<StatusOr<MountedApexData>> mounts(count);
+
+  std::vector<size_t> to_mount;
+  std::vector<size_t> to_commit;
+  // Other versions of a package in the same batch depend on the outcome of
+  // the first one, so they go through the sequential path afterwards.
+  std::vector<size_t> deferred;
+  std::unordered_set<std::string> names;
+  for (size_t i = 0; i < count; ++i) {
+    const ApexManifest& manifest = apexes[i].GetManifest();
+    if (!names.insert(manifest.name()).second) {
+      deferred.push_back(i);
+      continue;
+    }
+    if (skipActivationInCurrentPhase(apexes[i])) {
+      continue;
+    }
+    infos[i] = getMountedVersionInfo(manifest);
+    if (infos[i].version_found_active) {
+      LOG(DEBUG) << "Package " << manifest.name() << " with version "
+                 << manifest.version() << " already active";
+      continue;
+    }
+    if (!infos[i].version_found_mounted) {
+      to_mount.push_back(i);
+    }
+    to_commit.push_back(i);
+  }
+
+  // Only the packages that get mounted here need a loop device from the pool.
+  // Packages with an external hashtree need a second one, which is allocated
+  // on demand.
+  const size_t loop_devices_needed =
+      std::count_if(to_mount.begin(), to_mount.end(),
+                    [&apexes](size_t i) { return !apexes[i].IsFlattened(); });
+  ActivationBackend& backend = activationBackend();
+  if (loop_devices_needed > 0) {
+    Status pool_status = backend.PopulateLoopDevicePool(loop_devices_needed);
+    if (!pool_status.Ok()) {
+      LOG(WARNING) << "Failed to populate loop device pool : "
+                   << pool_status.ErrorMessage();
+    }
+  }
+
+  // Mounting happens in three stages. First, loop and dm-verity devices are
+  // created for all packages. Then we wait once for all the resulting block
+  // devices to show up in userspace, and finally all packages are mounted.
+  std::vector<std::unique_ptr<PreparedMount>> prepared(count);
+  ForEachInParallel(to_mount.size(), kMaxActivationThreads, [&](size_t j) {
+    const size_t i = to_mount[j];
+    const ApexManifest& manifest = apexes[i].GetManifest();
+    const std::string mount_point =
+        apexd_private::GetPackageMountPoint(manifest);
+    if (apexes[i].IsFlattened()) {
+      mounts[i] = MountPackageImpl(apexes[i], mount_point,
+                                   GetPackageId(manifest),
+                                   /* verifyImage = */ false);
+      return;
+    }
+    Status status = createMountPoint(mount_point);
+    if (!status.Ok()) {
+      mounts[i] = StatusOr<MountedApexData>::MakeError(status);
+      return;
+    }
+    StatusOr<PreparedMount> ret = prepareNonFlattenedMount(
+        apexes[i], GetPackageId(manifest), /* verifyImage = */ false);
+    if (!ret.Ok()) {
+      removeMountPoint(mount_point);
+      mounts[i] = StatusOr<MountedApexData>::MakeError(ret.ErrorStatus());
+      return;
+    }
+    prepared[i] = std::make_unique<PreparedMount>(std::move(*ret));
+  });
+  // Packages that failed before binding a loop device leave theirs unused.
+  backend.ReleaseLoopDevicePool();
+
+  std::vector<size_t> to_finish;
+  std::vector<std::string> devices;
+  for (size_t i : to_mount) {
+    if (prepared[i] != nullptr) {
+      to_finish.push_back(i);
+      devices.push_back(prepared[i]->blockDevice);
+    }
+  }
+  // Even though the kernel has created the devices, we still depend on
+  // ueventd to run to actually create the device nodes in userspace. If not
+  // all of them show up in time, each package falls back to waiting for its
+  // own device, so that only the affected ones fail.
+  const trace::Clock::time_point wait_start = trace::Clock::now();
+  const bool devices_ready =
+      devices.empty() || waitForDevices(devices, kWaitToBeCreated).Ok();
+  const trace::Clock::time_point wait_end = trace::Clock::now();
+  for (size_t i : to_finish) {
+    trace::Record(trace::Phase::kDeviceWait, apexes[i].GetPath(), wait_start,
+                  wait_end);
+  }
+
+  ForEachInParallel(to_finish.size(), kMaxActivationThreads, [&](size_t j) {
+    const size_t i = to_finish[j];
+    const ApexManifest& manifest = apexes[i].GetManifest();
+    const std::string mount_point =
+        apexd_private::GetPackageMountPoint(manifest);
+    Status deviceStatus = Status::Success();
+    if (!devices_ready) {
+      trace::ScopedPhase phase(trace::Phase::kDeviceWait, apexes[i].GetPath());
+      deviceStatus = waitForDevice(prepared[i]->blockDevice, kWaitToBeCreated);
+    }
+    if (deviceStatus.Ok()) {
+      mounts[i] = finishNonFlattenedMount(apexes[i], *prepared[i], mount_point,
+                                          GetPackageId(manifest),
+                                          /* verifyImage = */ false);
+    } else {
+      mounts[i] = StatusOr<MountedApexData>::MakeError(deviceStatus);
+    }
+    if (!mounts[i].Ok()) {
+      removeMountPoint(mount_point);
+    }
+    // Tears down the devices unless the mount succeeded.
+    prepared[i].reset();
+  });
+
+  for (size_t i : to_commit) {
+    if (!infos[i].version_found_mounted) {
+      if (!mounts[i].Ok()) {
+        results[i] = mounts[i].ErrorStatus();
+        continue;
+      }
+      mounts[i]->apex_file = std::make_shared<const ApexFile>(apexes[i]);
+      gMountedApexes.AddMountedApex(apexes[i].GetManifest().name(), false,
+                                    std::move(*mounts[i]));
+    }
+    results[i] = activateMountedPackage(apexes[i], infos[i].is_newest_version);
+  }
+
+  for (size_t i : deferred) {
+    results[i] = activatePackageImpl(apexes[i]);
+  }
+  return results;
+}
+
+}  // namespace
+
 Status activatePackage(const std::string& full_path) {
   LOG(INFO) << "Trying to activate " << full_path;
 
-  StatusOr<ApexFile> apex_file = ApexFile::Open(full_path);
+  StatusOr<ApexFile> apex_file = ApexFileCache::GetInstance().Open(full_path);
   if (!apex_file.Ok()) {
     return apex_file.ErrorStatus();
   }
@@ -1208,7 +1838,7 @@ Status activatePackage(const std::string& full_path) {
 Status deactivatePackage(const std::string& full_path) {
   LOG(INFO) << "Trying to deactivate " << full_path;
 
-  StatusOr<ApexFile> apexFile = ApexFile::Open(full_path);
+  StatusOr<ApexFile> apexFile = ApexFileCache::GetInstance().Open(full_path);
   if (!apexFile.Ok()) {
     return apexFile.ErrorStatus();
   }
@@ -1224,7 +1854,7 @@ std::vector<ApexFile> getActivePackages() {
           return;
         }
 
-        StatusOr<ApexFile> apexFile = ApexFile::Open(data.full_path);
+        StatusOr<ApexFile> apexFile = getMountedApexFile(data);
         if (!apexFile.Ok()) {
           // TODO: Fail?
           return;
@@ -1235,6 +1865,10 @@ std::vector<ApexFile> getActivePackages() {
   return ret;
 }
 
+uint64_t getActivePackagesGeneration() {
+  return gMountedApexes.GetGeneration();
+}
+
 namespace {
 std::unordered_map<std::string, uint64_t> GetActivePackagesMap() {
   std::vector<ApexFile> active_packages = getActivePackages();
@@ -1248,31 +1882,72 @@ std::unordered_map<std::string, uint64_t> GetActivePackagesMap() {
 
 }  // namespace
 
-std::vector<ApexFile> getFactoryPackages() {
-  std::vector<ApexFile> ret;
-  for (const auto& dir : kApexPackageBuiltinDirs) {
-    auto apex_files = FindApexFilesByName(dir, /* include_dirs=*/false);
-    if (!apex_files.Ok()) {
-      LOG(ERROR) << apex_files.ErrorMessage();
-      continue;
-    }
-    for (const std::string& path : *apex_files) {
-      StatusOr<ApexFile> apex_file = ApexFile::Open(path);
-      if (!apex_file.Ok()) {
-        LOG(ERROR) << apex_file.ErrorMessage();
-      } else {
-        ret.emplace_back(std::move(*apex_file));
+namespace {
+
+// Packages on the builtin partitions, which are read-only, so they only need
+// to be scanned once.
+struct FactoryInventory {
+  std::vector<ApexFile> packages;
+  // Indexes into |packages|.
+  std::unordered_multimap<std::string, size_t> by_name;
+};
+
+const FactoryInventory& getFactoryInventory() {
+  static const FactoryInventory inventory = []() {
+    FactoryInventory ret;
+    for (const auto& dir : kApexPackageBuiltinDirs) {
+      auto apex_files = FindApexFilesByName(dir, /* include_dirs=*/false);
+      if (!apex_files.Ok()) {
+        LOG(ERROR) << apex_files.ErrorMessage();
+        continue;
+      }
+      for (const std::string& path : *apex_files) {
+        StatusOr<ApexFile> apex_file = ApexFileCache::GetInstance().Open(path);
+        if (!apex_file.Ok()) {
+          LOG(ERROR) << apex_file.ErrorMessage();
+          continue;
+        }
+        ret.by_name.emplace(apex_file->GetManifest().name(),
+                            ret.packages.size());
+        ret.packages.emplace_back(std::move(*apex_file));
       }
     }
+    LOG(DEBUG) << "Found " << ret.packages.size() << " factory packages";
+    return ret;
+  }();
+  return inventory;
+}
+
+}  // namespace
+
+const std::vector<ApexFile>& getFactoryPackages() {
+  return getFactoryInventory().packages;
+}
+
+const ApexFile* getFactoryPackage(const std::string& name, int64_t version) {
+  const FactoryInventory& inventory = getFactoryInventory();
+  auto range = inventory.by_name.equal_range(name);
+  for (auto it = range.first; it != range.second; ++it) {
+    const ApexFile& apex_file = inventory.packages[it->second];
+    if (apex_file.GetManifest().version() == version) {
+      return &apex_file;
+    }
   }
-  return ret;
+  return nullptr;
 }
 
 StatusOr<ApexFile> getActivePackage(const std::string& packageName) {
-  std::vector<ApexFile> packages = getActivePackages();
-  for (ApexFile& apex : packages) {
-    if (apex.GetManifest().name() == packageName) {
-      return StatusOr<ApexFile>(std::move(apex));
+  std::optional<MountedApexData> active;
+  gMountedApexes.ForallMountedApexes(
+      packageName, [&](const MountedApexData& data, bool latest) {
+        if (latest) {
+          active.emplace(data);
+        }
+      });
+  if (active.has_value()) {
+    StatusOr<ApexFile> apexFile = getMountedApexFile(*active);
+    if (apexFile.Ok()) {
+      return apexFile;
     }
   }
 
@@ -1307,6 +1982,7 @@ Status abortActiveSession() {
 
 Status scanPackagesDirAndActivate(const char* apex_package_dir) {
   LOG(INFO) << "Scanning " << apex_package_dir << " looking for APEX packages.";
+  trace::ScopedPhase scan_phase(trace::Phase::kScan, apex_package_dir);
 
   const bool scanBuiltinApexes = isPathForBuiltinApexes(apex_package_dir);
   StatusOr<std::vector<std::string>> scan =
@@ -1321,10 +1997,14 @@ Status scanPackagesDirAndActivate(const char* apex_package_dir) {
   std::vector<std::string> failed_pkgs;
   size_t activated_cnt = 0;
   size_t skipped_cnt = 0;
+  std::vector<ApexFile> apexes_to_activate;
   for (const std::string& name : *scan) {
     LOG(INFO) << "Found " << name;
 
-    StatusOr<ApexFile> apex_file = ApexFile::Open(name);
+    StatusOr<ApexFile> apex_file = [&name]() {
+      trace::ScopedPhase phase(trace::Phase::kOpen, name);
+      return ApexFileCache::GetInstance().Open(name);
+    }();
     if (!apex_file.Ok()) {
       LOG(ERROR) << "Failed to activate " << name << " : "
                  << apex_file.ErrorMessage();
@@ -1343,17 +2023,22 @@ Status scanPackagesDirAndActivate(const char* apex_package_dir) {
       continue;
     }
 
-    if (!kUpdatable && !apex_file->IsFlattened()) {
+    if (!isUpdatable() && !apex_file->IsFlattened()) {
       LOG(INFO) << "Skipping activation of non-flattened apex package " << name
                 << " because device doesn't support it";
       skipped_cnt++;
       continue;
     }
 
-    Status res = activatePackageImpl(*apex_file);
-    if (!res.Ok()) {
+    apexes_to_activate.emplace_back(std::move(*apex_file));
+  }
+
+  std::vector<Status> results = activatePackagesInParallel(apexes_to_activate);
+  for (size_t i = 0; i < apexes_to_activate.size(); ++i) {
+    const std::string& name = apexes_to_activate[i].GetPath();
+    if (!results[i].Ok()) {
       LOG(ERROR) << "Failed to activate " << name << " : "
-                 << res.ErrorMessage();
+                 << results[i].ErrorMessage();
       failed_pkgs.push_back(name);
     } else {
       activated_cnt++;
@@ -1513,6 +2198,67 @@ std::vector<std::string> FilterUnnecessaryStagingPaths(
   return ret;
 }
 
+// Deletes the hashtrees in kApexHashTreeDir that are of none of the packages
+// in kActiveApexPackagesDataDir or kApexBackupDir, and of no mounted package.
+// Keeping the ones of backed up packages saves generating them again after a
+// rollback.
+void removeObsoleteHashTrees() {
+  auto exists = PathExists(kApexHashTreeDir);
+  if (!exists.Ok() || !*exists) {
+    return;
+  }
+
+  std::unordered_set<std::string> in_use;
+  for (const char* dir : {kActiveApexPackagesDataDir, kApexBackupDir}) {
+    exists = PathExists(dir);
+    if (!exists.Ok()) {
+      LOG(ERROR) << "Not removing hashtrees : " << exists.ErrorMessage();
+      return;
+    }
+    if (!*exists) {
+      continue;
+    }
+    auto packages = FindApexFilesByName(dir, /* include_dirs= */ false);
+    if (!packages.Ok()) {
+      LOG(ERROR) << "Not removing hashtrees : " << packages.ErrorMessage();
+      return;
+    }
+    for (const std::string& path : *packages) {
+      StatusOr<std::string> package_id = getStoredPackageId(path);
+      if (!package_id.Ok()) {
+        LOG(ERROR) << "Not removing hashtrees : " << package_id.ErrorMessage();
+        return;
+      }
+      in_use.insert(getHashTreePath(*package_id));
+    }
+  }
+  gMountedApexes.ForallMountedApexes([&](const std::string&,
+                                         const MountedApexData& data, bool) {
+    if (data.hashtree_loop_name.empty()) {
+      return;
+    }
+    StatusOr<ApexFile> apex = getMountedApexFile(data);
+    if (apex.Ok()) {
+      in_use.insert(getHashTreePath(apex->GetManifest()));
+    }
+  });
+
+  auto hashtrees = ReadDir(kApexHashTreeDir, [](auto _) { return true; });
+  if (!hashtrees.Ok()) {
+    LOG(ERROR) << "Not removing hashtrees : " << hashtrees.ErrorMessage();
+    return;
+  }
+  for (const std::string& path : *hashtrees) {
+    if (in_use.count(path) != 0) {
+      continue;
+    }
+    LOG(INFO) << "Removing obsolete hashtree " << path;
+    if (unlink(path.c_str()) != 0) {
+      PLOG(ERROR) << "Failed to remove " << path;
+    }
+  }
+}
+
 }  // namespace
 
 Status stagePackages(const std::vector<std::string>& tmpPaths) {
@@ -1551,42 +2297,24 @@ Status stagePackages(const std::vector<std::string>& tmpPaths) {
   }
 
   // 3) Now stage all of them.
-
-  // Ensure the APEX gets removed on failure.
-  std::unordered_set<std::string> staged_files;
-  auto deleter = [&staged_files]() {
-    for (const std::string& staged_path : staged_files) {
-      if (TEMP_FAILURE_RETRY(unlink(staged_path.c_str())) != 0) {
-        PLOG(ERROR) << "Unable to unlink " << staged_path;
-      }
-    }
-  };
-  auto scope_guard = android::base::make_scope_guard(deleter);
-
+  std::unordered_map<std::string, std::string> new_files;
   std::unordered_set<std::string> staged_packages;
   for (const std::string& path : paths_to_stage) {
-    StatusOr<ApexFile> apex_file = ApexFile::Open(path);
+    StatusOr<ApexFile> apex_file = ApexFileCache::GetInstance().Open(path);
     if (!apex_file.Ok()) {
       return apex_file.ErrorStatus();
     }
-    std::string dest_path = StageDestPath(*apex_file);
-
-    if (link(apex_file->GetPath().c_str(), dest_path.c_str()) != 0) {
-      // TODO: Get correct binder error status.
-      return Status::Fail(PStringLog()
-                          << "Unable to link " << apex_file->GetPath() << " to "
-                          << dest_path);
+    // Done ahead of the commit, so that a package whose hashtree can't be
+    // generated isn't staged. Activation only checks the hashtree.
+    Status status = generateHashTreeIfNeeded(*apex_file);
+    if (!status.Ok()) {
+      return status;
     }
-    staged_files.insert(dest_path);
+    new_files.emplace(StageDestPath(*apex_file), apex_file->GetPath());
     staged_packages.insert(apex_file->GetManifest().name());
-
-    LOG(DEBUG) << "Success linking " << apex_file->GetPath() << " to "
-               << dest_path;
   }
 
-  scope_guard.Disable();  // Accept the state.
-
-  return RemovePreviouslyActiveApexFiles(staged_packages, staged_files);
+  return CommitActivePackages(new_files, staged_packages);
 }
 
 Status unstagePackages(const std::vector<std::string>& paths) {
@@ -1610,6 +2338,7 @@ Status unstagePackages(const std::vector<std::string>& paths) {
     }
   }
 
+  removeObsoleteHashTrees();
   return Status::Success();
 }
 
@@ -1661,6 +2390,7 @@ Status rollbackActiveSessionAndReboot() {
 }
 
 int onBootstrap() {
+  trace::ScopedPhase phase(trace::Phase::kStartup, "onBootstrap");
   gBootstrap = true;
 
   Status preAllocate = preAllocateLoopDevices();
@@ -1687,6 +2417,7 @@ int onBootstrap() {
 }
 
 void onStart(CheckpointInterface* checkpoint_service) {
+  trace::ScopedPhase phase(trace::Phase::kStartup, "onStart");
   LOG(INFO) << "Marking APEXd as starting";
   if (!android::base::SetProperty(kApexStatusSysprop, kApexStatusStarting)) {
     PLOG(ERROR) << "Failed to set " << kApexStatusSysprop << " to "
@@ -1714,6 +2445,15 @@ void onStart(CheckpointInterface* checkpoint_service) {
     }
   }
 
+  // Sessions stored by an older apexd are moved to the journal once, before
+  // any of them is used. Sessions can be read without migrating them, so a
+  // failure isn't fatal.
+  Status migrate_status = ApexSession::MigrateLegacySessions();
+  if (!migrate_status.Ok()) {
+    LOG(ERROR) << "Failed to migrate sessions : "
+               << migrate_status.ErrorMessage();
+  }
+
   // Ask whether we should roll back any staged sessions; this can happen if
   // we've exceeded the retry count on a device that supports filesystem
   // checkpointing.
@@ -1741,6 +2481,11 @@ void onStart(CheckpointInterface* checkpoint_service) {
     return;
   }
 
+  status = ApexFileCache::GetInstance().LoadIndex(kApexIndexFile);
+  if (!status.Ok()) {
+    LOG(WARNING) << "Ignoring APEX index : " << status.ErrorMessage();
+  }
+
   gMountedApexes.PopulateFromMounts();
 
   // Activate APEXes from /data/apex. If one in the directory is newer than the
@@ -1772,6 +2517,20 @@ void onStart(CheckpointInterface* checkpoint_service) {
                  << status.ErrorMessage();
     }
   }
+
+  // Staged sessions have been applied or rolled back by now, so hashtrees
+  // that aren't needed anymore can go.
+  removeObsoleteHashTrees();
+
+  status = ApexFileCache::GetInstance().SaveIndex(kApexIndexFile,
+                                                  kActiveApexPackagesDataDir);
+  if (!status.Ok()) {
+    LOG(ERROR) << "Failed to save APEX index : " << status.ErrorMessage();
+  }
+
+  // Built now, while the builtin packages are in the cache, rather than on
+  // the first query.
+  getFactoryInventory();
 }
 
 void onAllPackagesReady() {
@@ -1788,7 +2547,8 @@ void onAllPackagesReady() {
 }
 
 StatusOr<std::vector<ApexFile>> submitStagedSession(
-    const int session_id, const std::vector<int>& child_session_ids) {
+    const int session_id, const std::vector<int>& child_session_ids,
+    const SubmitProgressFn& progress) {
   bool needsBackup = true;
   Status cleanup_status = ClearSessions();
   if (!cleanup_status.Ok()) {
@@ -1823,13 +2583,45 @@ StatusOr<std::vector<ApexFile>> submitStagedSession(
     ids_to_scan = {session_id};
   }
 
+  Status duplicates_status = checkNoDuplicatePackages(ids_to_scan);
+  if (!duplicates_status.Ok()) {
+    return StatusOr<std::vector<ApexFile>>::MakeError(duplicates_status);
+  }
+
+  // Each package is temp-mounted on its own mount point and dm device, so
+  // child sessions can be verified concurrently. Sessions after one that
+  // failed are skipped, but all before it are verified, so the error reported
+  // is the same as if they were verified one after the other.
+  const size_t num_threads = android::base::GetUintProperty<size_t>(
+      kVerificationThreadsProp, kDefaultVerificationThreads,
+      kMaxVerificationThreads);
+  std::vector<std::optional<StatusOr<ApexFile>>> verified(ids_to_scan.size());
+  std::atomic<size_t> first_failed(ids_to_scan.size());
+  std::mutex progress_mutex;
+  size_t num_verified = 0;
+  ForEachInParallel(ids_to_scan.size(), num_threads, [&](size_t i) {
+    if (i > first_failed) {
+      return;
+    }
+    verified[i].emplace(verifySessionDir(ids_to_scan[i]));
+    if (!verified[i]->Ok()) {
+      size_t failed = first_failed;
+      while (i < failed && !first_failed.compare_exchange_weak(failed, i)) {
+      }
+      return;
+    }
+    if (progress) {
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      progress(++num_verified, ids_to_scan.size());
+    }
+  });
+
   std::vector<ApexFile> ret;
-  for (int id_to_scan : ids_to_scan) {
-    auto verified = verifySessionDir(id_to_scan);
-    if (!verified.Ok()) {
-      return StatusOr<std::vector<ApexFile>>::MakeError(verified.ErrorStatus());
+  for (auto& apex : verified) {
+    if (!apex->Ok()) {
+      return StatusOr<std::vector<ApexFile>>::MakeError(apex->ErrorStatus());
     }
-    ret.push_back(std::move(*verified));
+    ret.push_back(std::move(**apex));
   }
 
   // Run preinstall, if necessary.
@@ -1915,6 +2707,7 @@ void unmountDanglingMounts() {
     }
     if (StartsWith(path, kActiveApexPackagesDataDir)) {
       LOG(VERBOSE) << "Deleting old APEX " << path;
+      ApexFileCache::GetInstance().Invalidate(path);
       if (unlink(path.c_str()) != 0) {
         PLOG(ERROR) << "Failed to delete " << path;
       }
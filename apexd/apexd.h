@@ -17,6 +17,7 @@
 #ifndef ANDROID_APEXD_APEXD_H_
 #define ANDROID_APEXD_APEXD_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -30,8 +31,13 @@
 namespace android {
 namespace apex {
 
+class ActivationBackend;
 class CheckpointInterface;
 
+// Makes apexd mount packages through |backend| instead of the kernel. Must be
+// called before any package is activated.
+void setActivationBackend(ActivationBackend* backend);
+
 Status resumeRollbackIfNeeded();
 
 Status scanPackagesDirAndActivate(const char* apex_package_dir);
@@ -43,9 +49,13 @@ Status postinstallPackages(const std::vector<std::string>& paths) WARN_UNUSED;
 Status stagePackages(const std::vector<std::string>& tmpPaths) WARN_UNUSED;
 Status unstagePackages(const std::vector<std::string>& paths) WARN_UNUSED;
 
+// Called with the number of verified packages and the total number of packages
+// while a session is being submitted.
+using SubmitProgressFn = std::function<void(size_t, size_t)>;
+
 StatusOr<std::vector<ApexFile>> submitStagedSession(
-    const int session_id,
-    const std::vector<int>& child_session_ids) WARN_UNUSED;
+    const int session_id, const std::vector<int>& child_session_ids,
+    const SubmitProgressFn& progress = nullptr) WARN_UNUSED;
 Status markStagedSessionReady(const int session_id) WARN_UNUSED;
 Status markStagedSessionSuccessful(const int session_id) WARN_UNUSED;
 Status rollbackActiveSession();
@@ -55,9 +65,15 @@ Status activatePackage(const std::string& full_path) WARN_UNUSED;
 Status deactivatePackage(const std::string& full_path) WARN_UNUSED;
 
 std::vector<ApexFile> getActivePackages();
+// Changes whenever the result of getActivePackages() may have changed.
+uint64_t getActivePackagesGeneration();
 StatusOr<ApexFile> getActivePackage(const std::string& package_name);
 
-std::vector<ApexFile> getFactoryPackages();
+// Returns the packages on the builtin partitions. They're scanned once, since
+// the partitions are read-only.
+const std::vector<ApexFile>& getFactoryPackages();
+// Returns the factory package with |name| and |version|, or nullptr.
+const ApexFile* getFactoryPackage(const std::string& name, int64_t version);
 
 Status abortActiveSession();
 
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_BACKEND_H_
+#define ANDROID_APEXD_APEXD_BACKEND_H_
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "apex_file.h"
+#include "apexd_loop.h"
+#include "status.h"
+#include "status_or.h"
+
+namespace android {
+namespace apex {
+
+// Everything apexd needs from the kernel to activate packages: loop and
+// dm-verity devices, their nodes and sysfs attributes, and mounts. Devices
+// use GetKernelActivationBackend(). Anything else, e.g. a benchmark on the
+// host, runs the activation path against its own backend.
+class ActivationBackend {
+ public:
+  virtual ~ActivationBackend() {}
+
+  // Directory that packages are mounted in. kApexRoot on devices.
+  virtual std::string GetMountRoot() = 0;
+
+  // See apexd_loop.h.
+  virtual Status PreAllocateLoopDevices(size_t num) = 0;
+  virtual Status PopulateLoopDevicePool(size_t num) = 0;
+  virtual void ReleaseLoopDevicePool() = 0;
+  virtual StatusOr<loop::LoopbackDeviceUniqueFd> CreateLoopDevice(
+      const std::string& target, int32_t image_offset, size_t image_size) = 0;
+  virtual void DestroyLoopDevice(const std::string& path,
+                                 const loop::DestroyLoopFn& extra) = 0;
+  virtual Status ConfigureReadAhead(const std::string& device_path) = 0;
+
+  // Creates the dm-verity device |name| for the image on |data_device|, whose
+  // hashtree is on |hash_device|, and returns the path of its node.
+  virtual StatusOr<std::string> CreateVerityDevice(
+      const std::string& name, const ApexVerityData& verity_data,
+      const std::string& data_device, const std::string& hash_device,
+      bool restart_on_corruption) = 0;
+  // Fails if there is no device |name|.
+  virtual StatusOr<std::string> GetVerityDevicePath(
+      const std::string& name) = 0;
+  virtual Status DeleteVerityDevice(const std::string& name) = 0;
+
+  // Waits until all |devices| have a node, or none of them has if |created| is
+  // false. Nodes are created and removed by ueventd.
+  virtual Status WaitForDevices(const std::vector<std::string>& devices,
+                                bool created,
+                                std::chrono::milliseconds timeout) = 0;
+
+  // Same as mount(2), and umount2(2) with UMOUNT_NOFOLLOW | MNT_DETACH. They
+  // return 0 on success, and -1 with errno set otherwise.
+  virtual int Mount(const std::string& source, const std::string& target,
+                    const char* fs_type, unsigned long flags) = 0;
+  virtual int Unmount(const std::string& target) = 0;
+};
+
+// Returns the backend that talks to the kernel. Only built for devices.
+ActivationBackend& GetKernelActivationBackend();
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_BACKEND_H_
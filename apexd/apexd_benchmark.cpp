@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for package activation: parsing and verifying packages, the
+// ApexFile cache and its index, the database of mounted packages, restoring
+// it from mountinfo, loading sessions and the activation path itself.
+// Synthetic trees of 10 to 500 packages are created from the test APEX, each
+// with a package name of its own.
+//
+// Everything runs against synthetic sysfs and session directories, and
+// activation goes through a fake ActivationBackend, so that the benchmarks run
+// on the host and don't depend on the packages installed on a device.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/scopeguard.h>
+#include <android-base/stringprintf.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <libavb/libavb.h>
+#include <openssl/nid.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "apex_database.h"
+#include "apex_file.h"
+#include "apex_file_cache.h"
+#include "apexd.h"
+#include "apexd_backend.h"
+#include "apexd_private.h"
+#include "apexd_session.h"
+
+#include "session_state.pb.h"
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace apex {
+namespace {
+
+const std::string kTestApex =
+    android::base::GetExecutableDirectory() + "/apex.apexd_test.apex";
+const std::string kTestKey =
+    android::base::GetExecutableDirectory() +
+    "/apexd_testdata/com.android.apex.test_package.pem";
+constexpr const char* kTestPackageName = "com.android.apex.test_package";
+constexpr const char* kManifestFilename = "apex_manifest.json";
+constexpr const char* kImageFilename = "apex_payload.img";
+
+void ReplaceAll(std::string* data, size_t begin, size_t end,
+                const std::string& from, const std::string& to) {
+  CHECK_EQ(from.size(), to.size());
+  for (size_t pos = data->find(from, begin);
+       pos != std::string::npos && pos + from.size() <= end;
+       pos = data->find(from, pos + to.size())) {
+    data->replace(pos, from.size(), to);
+  }
+}
+
+// Renames the package in the vbmeta of |image|, whose apex.key property must
+// match the name in the manifest, and signs it again with |key|.
+void RenameInVbMeta(std::string* image, const std::string& name, RSA* key) {
+  CHECK_GE(image->size(), AVB_FOOTER_SIZE);
+  AvbFooter footer;
+  CHECK(avb_footer_validate_and_byteswap(
+      reinterpret_cast<const AvbFooter*>(image->data() + image->size() -
+                                         AVB_FOOTER_SIZE),
+      &footer));
+  auto* vbmeta = reinterpret_cast<uint8_t*>(&(*image)[footer.vbmeta_offset]);
+  AvbVBMetaImageHeader header;
+  avb_vbmeta_image_header_to_host_byte_order(
+      reinterpret_cast<const AvbVBMetaImageHeader*>(vbmeta), &header);
+  CHECK(header.algorithm_type >= AVB_ALGORITHM_TYPE_SHA256_RSA2048 &&
+        header.algorithm_type <= AVB_ALGORITHM_TYPE_SHA256_RSA8192);
+  CHECK_EQ(header.hash_size, static_cast<uint64_t>(SHA256_DIGEST_LENGTH));
+  CHECK_EQ(header.signature_size, static_cast<uint64_t>(RSA_size(key)));
+
+  uint8_t* auth = vbmeta + AVB_VBMETA_IMAGE_HEADER_SIZE;
+  uint8_t* aux = auth + header.authentication_data_block_size;
+  const size_t aux_offset = aux - reinterpret_cast<uint8_t*>(image->data());
+  ReplaceAll(image, aux_offset, aux_offset + header.auxiliary_data_block_size,
+             kTestPackageName, name);
+
+  // The header and the auxiliary block are signed.
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, vbmeta, AVB_VBMETA_IMAGE_HEADER_SIZE);
+  SHA256_Update(&ctx, aux, header.auxiliary_data_block_size);
+  SHA256_Final(digest, &ctx);
+  memcpy(auth + header.hash_offset, digest, sizeof(digest));
+  unsigned int signature_size = 0;
+  CHECK_EQ(1, RSA_sign(NID_sha256, digest, sizeof(digest),
+                       auth + header.signature_offset, &signature_size, key));
+  CHECK_EQ(header.signature_size, signature_size);
+}
+
+// Writes a copy of the test APEX to |path| that is named |name|, which must
+// be as long as the original name so that nothing moves. The image isn't
+// changed, so the manifest in its filesystem still has the original name.
+void WriteRenamedApex(const std::string& path, const std::string& name,
+                      RSA* key) {
+  ZipArchiveHandle handle;
+  CHECK_EQ(0, OpenArchive(kTestApex.c_str(), &handle));
+  auto close_guard =
+      android::base::make_scope_guard([&handle] { CloseArchive(handle); });
+  void* cookie;
+  CHECK_EQ(0, StartIteration(handle, &cookie, nullptr, nullptr));
+  auto iteration_guard =
+      android::base::make_scope_guard([cookie] { EndIteration(cookie); });
+
+  std::unique_ptr<FILE, decltype(&fclose)> out(fopen(path.c_str(), "wbe"),
+                                               fclose);
+  CHECK(out != nullptr) << path;
+  ZipWriter writer(out.get());
+  ZipEntry entry;
+  ZipString entry_name;
+  int32_t ret;
+  while ((ret = Next(cookie, &entry, &entry_name)) == 0) {
+    const std::string entry_path(reinterpret_cast<const char*>(entry_name.name),
+                                 entry_name.name_length);
+    std::string content(entry.uncompressed_length, '\0');
+    CHECK_EQ(0, ExtractToMemory(handle, &entry,
+                                reinterpret_cast<uint8_t*>(content.data()),
+                                content.size()));
+    if (entry_path == kManifestFilename) {
+      ReplaceAll(&content, 0, content.size(), kTestPackageName, name);
+    } else if (entry_path == kImageFilename) {
+      RenameInVbMeta(&content, name, key);
+    }
+    // Stored entries, like the image, are aligned for loop devices.
+    CHECK_EQ(0, entry.method == kCompressStored
+                    ? writer.StartAlignedEntry(entry_path.c_str(), 0, 4096)
+                    : writer.StartEntry(entry_path.c_str(),
+                                        ZipWriter::kCompress));
+    CHECK_EQ(0, writer.WriteBytes(content.data(), content.size()));
+    CHECK_EQ(0, writer.FinishEntry());
+  }
+  CHECK_EQ(-1, ret) << ErrorCodeString(ret);
+  CHECK_EQ(0, writer.Finish());
+}
+
+// A directory with |count| copies of the test APEX, each with its own package
+// name.
+class SyntheticApexTree {
+ public:
+  explicit SyntheticApexTree(size_t count) {
+    std::unique_ptr<FILE, decltype(&fclose)> key_file(
+        fopen(kTestKey.c_str(), "re"), fclose);
+    CHECK(key_file != nullptr) << kTestKey;
+    std::unique_ptr<RSA, decltype(&RSA_free)> key(
+        PEM_read_RSAPrivateKey(key_file.get(), nullptr, nullptr, nullptr),
+        RSA_free);
+    CHECK(key != nullptr) << "Failed to read " << kTestKey;
+
+    for (size_t i = 0; i < count; ++i) {
+      std::string name = StringPrintf("com.android.apex.test_%07zu", i);
+      std::string path = StringPrintf("%s/apex%zu.apex", dir_.path, i);
+      WriteRenamedApex(path, name, key.get());
+      names_.push_back(std::move(name));
+      paths_.push_back(std::move(path));
+    }
+  }
+
+  const char* dir() const { return dir_.path; }
+  const std::vector<std::string>& names() const { return names_; }
+  const std::vector<std::string>& paths() const { return paths_; }
+
+  // Trees are expensive to create, so they are shared between benchmarks.
+  static const SyntheticApexTree& Get(size_t count) {
+    static std::map<size_t, std::unique_ptr<SyntheticApexTree>> trees;
+    auto& tree = trees[count];
+    if (tree == nullptr) {
+      tree = std::make_unique<SyntheticApexTree>(count);
+    }
+    return *tree;
+  }
+
+ private:
+  TemporaryDir dir_;
+  std::vector<std::string> names_;
+  std::vector<std::string> paths_;
+};
+
+void TreeSizes(benchmark::internal::Benchmark* b) {
+  for (int count : {10, 50, 100, 500}) {
+    b->Arg(count);
+  }
+}
+
+void BM_FindApexFilesByName(benchmark::State& state) {
+  const SyntheticApexTree& tree = SyntheticApexTree::Get(state.range(0));
+  for (auto _ : state) {
+    auto files = FindApexFilesByName(tree.dir(), /* include_dirs= */ false);
+    CHECK(files.Ok()) << files.ErrorMessage();
+    benchmark::DoNotOptimize(files);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FindApexFilesByName)->Apply(TreeSizes);
+
+void BM_ApexFileOpen(benchmark::State& state) {
+  const SyntheticApexTree& tree = SyntheticApexTree::Get(state.range(0));
+  for (auto _ : state) {
+    for (const std::string& path : tree.paths()) {
+      StatusOr<ApexFile> apex_file = ApexFile::Open(path);
+      CHECK(apex_file.Ok()) << apex_file.ErrorMessage();
+      benchmark::DoNotOptimize(apex_file);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ApexFileOpen)->Apply(TreeSizes);
+
+void BM_ApexFileCacheOpenWarm(benchmark::State& state) {
+  const SyntheticApexTree& tree = SyntheticApexTree::Get(state.range(0));
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  cache.Clear();
+  for (const std::string& path : tree.paths()) {
+    CHECK(cache.Open(path).Ok());
+  }
+  for (auto _ : state) {
+    for (const std::string& path : tree.paths()) {
+      StatusOr<ApexFile> apex_file = cache.Open(path);
+      CHECK(apex_file.Ok()) << apex_file.ErrorMessage();
+      benchmark::DoNotOptimize(apex_file);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ApexFileCacheOpenWarm)->Apply(TreeSizes);
+
+void BM_ApexFileCacheIndexRoundTrip(benchmark::State& state) {
+  const SyntheticApexTree& tree = SyntheticApexTree::Get(state.range(0));
+  const std::string index = std::string(tree.dir()) + "/index";
+  ApexFileCache& cache = ApexFileCache::GetInstance();
+  cache.Clear();
+  for (const std::string& path : tree.paths()) {
+    CHECK(cache.Open(path).Ok());
+  }
+  for (auto _ : state) {
+    Status status = cache.SaveIndex(index, tree.dir());
+    CHECK(status.Ok()) << status.ErrorMessage();
+    status = cache.LoadIndex(index);
+    CHECK(status.Ok()) << status.ErrorMessage();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ApexFileCacheIndexRoundTrip)->Apply(TreeSizes);
+
+void BM_VerifyApexVerity(benchmark::State& state) {
+  StatusOr<ApexFile> apex_file = ApexFile::Open(kTestApex);
+  CHECK(apex_file.Ok()) << apex_file.ErrorMessage();
+  for (auto _ : state) {
+    auto verity_or = apex_file->VerifyApexVerity();
+    CHECK(verity_or.Ok()) << verity_or.ErrorMessage();
+    benchmark::DoNotOptimize(verity_or);
+  }
+}
+BENCHMARK(BM_VerifyApexVerity);
+
+using MountedApexData = MountedApexDatabase::MountedApexData;
+
+void PopulateDatabase(MountedApexDatabase* db, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    db->AddMountedApex(StringPrintf("package%zu", i), true,
+                       StringPrintf("/dev/block/loop%zu", i),
+                       StringPrintf("/data/apex/active/package%zu.apex", i),
+                       StringPrintf("/apex/package%zu@1", i),
+                       StringPrintf("package%zu@1", i));
+  }
+}
+
+void BM_DatabaseAddMountedApex(benchmark::State& state) {
+  for (auto _ : state) {
+    MountedApexDatabase db;
+    PopulateDatabase(&db, state.range(0));
+    benchmark::DoNotOptimize(db);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DatabaseAddMountedApex)->Apply(TreeSizes);
+
+void BM_DatabaseLookupByPackage(benchmark::State& state) {
+  MountedApexDatabase db;
+  PopulateDatabase(&db, state.range(0));
+  std::vector<std::string> packages;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    packages.push_back(StringPrintf("package%" PRId64, i));
+  }
+  for (auto _ : state) {
+    for (const std::string& package : packages) {
+      db.ForallMountedApexes(package,
+                             [](const MountedApexData& data, bool latest) {
+                               benchmark::DoNotOptimize(data);
+                               benchmark::DoNotOptimize(latest);
+                             });
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DatabaseLookupByPackage)->Apply(TreeSizes);
+
+void BM_DatabaseSetLatest(benchmark::State& state) {
+  MountedApexDatabase db;
+  PopulateDatabase(&db, state.range(0));
+  std::vector<std::pair<std::string, std::string>> packages;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    packages.emplace_back(
+        StringPrintf("package%" PRId64, i),
+        StringPrintf("/data/apex/active/package%" PRId64 ".apex", i));
+  }
+  for (auto _ : state) {
+    for (const auto& package : packages) {
+      db.SetLatest(package.first, package.second);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DatabaseSetLatest)->Apply(TreeSizes);
+
+using ::apex::proto::SessionState;
+
+// Mounts of |tree| on dm-verity devices, in the format of
+// /proc/self/mountinfo, and the sysfs entries of those devices.
+class SyntheticMounts {
+ public:
+  explicit SyntheticMounts(const SyntheticApexTree& tree) {
+    for (size_t i = 0; i < tree.paths().size(); ++i) {
+      const std::string& name = tree.names()[i];
+      mountinfo_ += StringPrintf(
+          "%zu 1 253:%zu / /apex/%s@1 ro,nodev,noatime shared:%zu - "
+          "ext4 /dev/block/dm-%zu ro\n",
+          i + 100, i, name.c_str(), i, i);
+      const std::string dm = StringPrintf("%s/dm-%zu", sys_block_.path, i);
+      const std::string loop = StringPrintf("%s/loop%zu", sys_block_.path, i);
+      std::filesystem::create_directories(dm + "/dm");
+      std::filesystem::create_directories(dm + "/slaves");
+      std::filesystem::create_directories(loop + "/loop");
+      CHECK(android::base::WriteStringToFile(name + "@1\n", dm + "/dm/name"));
+      CHECK(android::base::WriteStringToFile(tree.paths()[i] + "\n",
+                                             loop + "/loop/backing_file"));
+      CHECK_EQ(0, symlink(loop.c_str(),
+                          StringPrintf("%s/slaves/loop%zu", dm.c_str(), i)
+                              .c_str()));
+    }
+  }
+
+  const std::string& mountinfo() const { return mountinfo_; }
+  const char* sys_block_dir() const { return sys_block_.path; }
+
+ private:
+  std::string mountinfo_;
+  TemporaryDir sys_block_;
+};
+
+void BM_PopulateFromMounts(benchmark::State& state) {
+  const SyntheticApexTree& tree = SyntheticApexTree::Get(state.range(0));
+  SyntheticMounts mounts(tree);
+  ApexFileCache::GetInstance().Clear();
+  for (auto _ : state) {
+    MountedApexDatabase db;
+    db.PopulateFromMounts(mounts.mountinfo(), mounts.sys_block_dir());
+    benchmark::DoNotOptimize(db);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PopulateFromMounts)->Apply(TreeSizes);
+
+// Writes |count| sessions to |dir| in the format used before the journal.
+void WriteLegacySessions(const std::string& dir, size_t count) {
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  for (size_t i = 0; i < count; ++i) {
+    SessionState session;
+    session.set_id(i + 1);
+    session.set_state(i % 2 == 0 ? SessionState::SUCCESS
+                                 : SessionState::ACTIVATED);
+    session.add_child_session_ids(i + count + 1);
+    const std::string session_dir = StringPrintf("%s/%zu", dir.c_str(), i + 1);
+    CHECK_EQ(0, mkdir(session_dir.c_str(), 0700));
+    std::string content;
+    CHECK(session.SerializeToString(&content));
+    CHECK(android::base::WriteStringToFile(content, session_dir + "/state"));
+  }
+}
+
+void BM_SessionsLoadJournal(benchmark::State& state) {
+  TemporaryDir root;
+  const std::string dir = std::string(root.path) + "/sessions";
+  WriteLegacySessions(dir, state.range(0));
+  // Moves the sessions to the journal.
+  CHECK_EQ(static_cast<size_t>(state.range(0)),
+           ApexSession::LoadSessionsFromDir(dir).size());
+  for (auto _ : state) {
+    auto sessions = ApexSession::LoadSessionsFromDir(dir);
+    CHECK_EQ(static_cast<size_t>(state.range(0)), sessions.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_SessionsLoadJournal)->Apply(TreeSizes);
+
+void BM_SessionsMigrateLegacy(benchmark::State& state) {
+  TemporaryDir root;
+  const std::string dir = std::string(root.path) + "/sessions";
+  for (auto _ : state) {
+    state.PauseTiming();
+    WriteLegacySessions(dir, state.range(0));
+    state.ResumeTiming();
+    auto sessions = ApexSession::LoadSessionsFromDir(dir);
+    CHECK_EQ(static_cast<size_t>(state.range(0)), sessions.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_SessionsMigrateLegacy)->Apply(TreeSizes);
+
+// Stands in for the kernel. Devices only exist as entries of its tables, and
+// mounting an image only puts the manifest of its package in the mount point,
+// which is all that activation reads from it. Mount points are in a directory
+// of its own.
+class FakeActivationBackend : public ActivationBackend {
+ public:
+  std::string GetMountRoot() override { return root_.path; }
+
+  Status PreAllocateLoopDevices(size_t num) override {
+    return Status::Success();
+  }
+
+  Status PopulateLoopDevicePool(size_t num) override {
+    return Status::Success();
+  }
+
+  void ReleaseLoopDevicePool() override {}
+
+  StatusOr<loop::LoopbackDeviceUniqueFd> CreateLoopDevice(
+      const std::string& target, int32_t image_offset,
+      size_t image_size) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string device = StringPrintf("/dev/block/loop%zu", next_loop_++);
+    backing_files_[device] = target;
+    return StatusOr<loop::LoopbackDeviceUniqueFd>(
+        loop::LoopbackDeviceUniqueFd(android::base::unique_fd(), device));
+  }
+
+  void DestroyLoopDevice(const std::string& path,
+                         const loop::DestroyLoopFn& extra) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    backing_files_.erase(path);
+  }
+
+  Status ConfigureReadAhead(const std::string& device_path) override {
+    return Status::Success();
+  }
+
+  StatusOr<std::string> CreateVerityDevice(
+      const std::string& name, const ApexVerityData& verity_data,
+      const std::string& data_device, const std::string& hash_device,
+      bool restart_on_corruption) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string device = StringPrintf("/dev/block/dm-%zu", next_dm_++);
+    verity_devices_[name] = device;
+    backing_files_[device] = backing_files_[data_device];
+    return StatusOr<std::string>(std::move(device));
+  }
+
+  StatusOr<std::string> GetVerityDevicePath(const std::string& name) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = verity_devices_.find(name);
+    if (it == verity_devices_.end()) {
+      return StatusOr<std::string>::MakeError("No device " + name);
+    }
+    return StatusOr<std::string>(it->second);
+  }
+
+  Status DeleteVerityDevice(const std::string& name) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = verity_devices_.find(name);
+    if (it == verity_devices_.end()) {
+      return Status::Fail("No device " + name);
+    }
+    backing_files_.erase(it->second);
+    verity_devices_.erase(it);
+    return Status::Success();
+  }
+
+  Status WaitForDevices(const std::vector<std::string>& devices, bool created,
+                        std::chrono::milliseconds timeout) override {
+    return Status::Success();
+  }
+
+  int Mount(const std::string& source, const std::string& target,
+            const char* fs_type, unsigned long flags) override {
+    if ((flags & MS_BIND) != 0) {
+      return 0;
+    }
+    std::string backing_file;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = backing_files_.find(source);
+      if (it == backing_files_.end()) {
+        errno = ENXIO;
+        return -1;
+      }
+      backing_file = it->second;
+    }
+    ZipArchiveHandle handle;
+    if (OpenArchive(backing_file.c_str(), &handle) != 0) {
+      errno = EIO;
+      return -1;
+    }
+    auto guard =
+        android::base::make_scope_guard([&handle] { CloseArchive(handle); });
+    ZipEntry entry;
+    if (FindEntry(handle, ZipString(kManifestFilename), &entry) != 0) {
+      errno = EIO;
+      return -1;
+    }
+    std::string manifest(entry.uncompressed_length, '\0');
+    if (ExtractToMemory(handle, &entry,
+                        reinterpret_cast<uint8_t*>(manifest.data()),
+                        manifest.size()) != 0 ||
+        !android::base::WriteStringToFile(
+            manifest, target + "/" + kManifestFilename)) {
+      errno = EIO;
+      return -1;
+    }
+    return 0;
+  }
+
+  int Unmount(const std::string& target) override {
+    std::error_code ec;
+    std::filesystem::remove(target + "/" + kManifestFilename, ec);
+    return 0;
+  }
+
+  // Drops all devices and mount points.
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    backing_files_.clear();
+    verity_devices_.clear();
+    for (const auto& entry : std::filesystem::directory_iterator(root_.path)) {
+      std::filesystem::remove_all(entry.path());
+    }
+  }
+
+ private:
+  TemporaryDir root_;
+  std::mutex mutex_;
+  size_t next_loop_ = 0;
+  size_t next_dm_ = 0;
+  // Files that loop devices are bound to, and that dm-verity devices are on.
+  std::unordered_map<std::string, std::string> backing_files_;
+  // Paths of dm-verity devices by name.
+  std::unordered_map<std::string, std::string> verity_devices_;
+};
+
+// Activates a tree of packages that were never activated before. Devices and
+// mounts of the previous iteration are dropped before each one.
+void BM_ScanPackagesDirAndActivate(benchmark::State& state) {
+  const SyntheticApexTree& tree = SyntheticApexTree::Get(state.range(0));
+  // Nothing else activates packages, so it stays set after the benchmark.
+  static FakeActivationBackend backend;
+  setActivationBackend(&backend);
+  for (auto _ : state) {
+    state.PauseTiming();
+    backend.Reset();
+    apexd_private::ForgetMountedApexes();
+    state.ResumeTiming();
+    Status status = scanPackagesDirAndActivate(tree.dir());
+    CHECK(status.Ok()) << status.ErrorMessage();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ScanPackagesDirAndActivate)->Apply(TreeSizes);
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
+
+int main(int argc, char** argv) {
+#ifndef __ANDROID__
+  // Non-flattened packages are only activated on devices that declare them
+  // updatable. The host has no build properties to declare it.
+  android::base::SetProperty("ro.apex.updatable", "true");
+#endif
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "apexd"
+
+#include "apexd_backend.h"
+
+#include <string.h>
+#include <sys/mount.h>
+
+#include <memory>
+
+#include <android-base/logging.h>
+#include <libavb/libavb.h>
+#include <libdm/dm.h>
+#include <libdm/dm_table.h>
+#include <libdm/dm_target.h>
+
+#include "apex_constants.h"
+#include "apexd_utils.h"
+#include "apexd_verity.h"
+#include "string_log.h"
+
+using android::dm::DeviceMapper;
+using android::dm::DmTable;
+using android::dm::DmTargetVerity;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// This should be in UAPI, but it's not :-(
+static constexpr const char* kDmVerityRestartOnCorruption =
+    "restart_on_corruption";
+
+// |hash_device| is the same as |data_device|, unless the hashtree is external.
+std::unique_ptr<DmTable> createVerityTable(const ApexVerityData& verity_data,
+                                           const std::string& data_device,
+                                           const std::string& hash_device,
+                                           bool restart_on_corruption) {
+  AvbHashtreeDescriptor* desc = verity_data.desc.get();
+  auto table = std::make_unique<DmTable>();
+
+  // The name is NUL-padded, but not terminated if it fills the field.
+  const char* hash_algorithm =
+      reinterpret_cast<const char*>(desc->hash_algorithm);
+
+  // An external hashtree starts at the beginning of its device.
+  const uint64_t hash_start_block =
+      HasExternalHashTree(verity_data)
+          ? 0
+          : desc->tree_offset / desc->hash_block_size;
+  auto target = std::make_unique<DmTargetVerity>(
+      0, desc->image_size / 512, desc->dm_verity_version, data_device,
+      hash_device, desc->data_block_size, desc->hash_block_size,
+      desc->image_size / desc->data_block_size, hash_start_block,
+      std::string(hash_algorithm,
+                  strnlen(hash_algorithm, sizeof(desc->hash_algorithm))),
+      BytesToHex(verity_data.root_digest), BytesToHex(verity_data.salt));
+
+  target->IgnoreZeroBlocks();
+  if (restart_on_corruption) {
+    target->SetVerityMode(kDmVerityRestartOnCorruption);
+  }
+  table->AddTarget(std::move(target));
+
+  table->set_readonly(true);
+
+  return table;
+}
+
+class KernelActivationBackend : public ActivationBackend {
+ public:
+  std::string GetMountRoot() override { return kApexRoot; }
+
+  Status PreAllocateLoopDevices(size_t num) override {
+    return loop::preAllocateLoopDevices(num);
+  }
+
+  Status PopulateLoopDevicePool(size_t num) override {
+    return loop::populateLoopDevicePool(num);
+  }
+
+  void ReleaseLoopDevicePool() override { loop::releaseLoopDevicePool(); }
+
+  StatusOr<loop::LoopbackDeviceUniqueFd> CreateLoopDevice(
+      const std::string& target, int32_t image_offset,
+      size_t image_size) override {
+    return loop::createLoopDevice(target, image_offset, image_size);
+  }
+
+  void DestroyLoopDevice(const std::string& path,
+                         const loop::DestroyLoopFn& extra) override {
+    loop::DestroyLoopDevice(path, extra);
+  }
+
+  Status ConfigureReadAhead(const std::string& device_path) override {
+    return loop::configureReadAhead(device_path);
+  }
+
+  StatusOr<std::string> CreateVerityDevice(
+      const std::string& name, const ApexVerityData& verity_data,
+      const std::string& data_device, const std::string& hash_device,
+      bool restart_on_corruption) override {
+    using StatusM = StatusOr<std::string>;
+    auto table = createVerityTable(verity_data, data_device, hash_device,
+                                   restart_on_corruption);
+    DeviceMapper& dm = DeviceMapper::Instance();
+    if (!dm.CreateDevice(name, *table)) {
+      return StatusM::MakeError("Couldn't create verity device.");
+    }
+    std::string dev_path;
+    if (!dm.GetDmDevicePathByName(name, &dev_path)) {
+      dm.DeleteDevice(name);
+      return StatusM::MakeError("Couldn't get verity device path!");
+    }
+    return StatusM(std::move(dev_path));
+  }
+
+  StatusOr<std::string> GetVerityDevicePath(const std::string& name) override {
+    using StatusM = StatusOr<std::string>;
+    std::string dev_path;
+    if (!DeviceMapper::Instance().GetDmDevicePathByName(name, &dev_path)) {
+      return StatusM::Fail(StringLog()
+                           << "Unable to get path for dm-verity device "
+                           << name);
+    }
+    return StatusM(std::move(dev_path));
+  }
+
+  Status DeleteVerityDevice(const std::string& name) override {
+    if (!DeviceMapper::Instance().DeleteDevice(name)) {
+      return Status::Fail(StringLog() << "Failed to delete device " << name);
+    }
+    return Status::Success();
+  }
+
+  Status WaitForDevices(const std::vector<std::string>& devices, bool created,
+                        std::chrono::milliseconds timeout) override {
+    return WaitForPaths(devices, /* exists = */ created, timeout);
+  }
+
+  int Mount(const std::string& source, const std::string& target,
+            const char* fs_type, unsigned long flags) override {
+    return mount(source.c_str(), target.c_str(), fs_type, flags, nullptr);
+  }
+
+  int Unmount(const std::string& target) override {
+    return umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH);
+  }
+};
+
+}  // namespace
+
+ActivationBackend& GetKernelActivationBackend() {
+  static KernelActivationBackend backend;
+  return backend;
+}
+
+}  // namespace apex
+}  // namespace android
@@ -27,6 +27,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
@@ -48,12 +53,177 @@ static constexpr const char* kApexLoopIdPrefix = "apex:";
 // 128 kB read-ahead, which we currently use for /system as well
 static constexpr const char* kReadAheadKb = "128";
 
-// TODO(b/122059364): Even though the kernel has created the loop
-// device, we still depend on ueventd to run to actually create the
-// device node in userspace. To solve this properly we should listen on
-// the netlink socket for uevents, or use inotify. For now, this will
-// have to do.
-static constexpr size_t kLoopDeviceRetryAttempts = 3u;
+// Even though the kernel has created the loop device, we still depend on
+// ueventd to run to actually create the device node in userspace.
+static constexpr auto kLoopDeviceNodeTimeout = 150ms;
+
+// Upper bound on the number of loop devices populateLoopDevicePool() looks
+// at when searching for unbound devices.
+static constexpr int kMaxLoopDevicePoolScan = 256;
+
+#ifndef LOOP_CONFIGURE
+// Introduced in Linux 5.8; binds the backing file and applies all attributes
+// in a single call.
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+  __u32 fd;
+  __u32 block_size;
+  struct loop_info64 info;
+  __u64 __reserved[8];
+};
+#endif
+
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+namespace {
+
+// Loop devices that were opened ahead of time and weren't bound to any file
+// at that point.
+std::mutex gLoopPoolLock;
+std::vector<std::pair<unique_fd, std::string>> gLoopPool;
+
+bool isLoopConfigureSupported(int device_fd) {
+  static std::once_flag once;
+  static bool supported = false;
+  std::call_once(once, [device_fd]() {
+    // Kernels without LOOP_CONFIGURE reject the unknown ioctl with EINVAL,
+    // newer ones fail to look up the invalid backing file.
+    struct loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = static_cast<__u32>(-1);
+    supported =
+        ioctl(device_fd, LOOP_CONFIGURE, &config) == -1 && errno == EBADF;
+    LOG(INFO) << "LOOP_CONFIGURE is " << (supported ? "" : "not ")
+              << "supported";
+  });
+  return supported;
+}
+
+void fillLoopInfo(const int32_t imageOffset, const size_t imageSize,
+                  struct loop_info64* li) {
+  memset(li, 0, sizeof(*li));
+  strlcpy((char*)li->lo_crypt_name, kApexLoopIdPrefix, LO_NAME_SIZE);
+  li->lo_offset = imageOffset;
+  li->lo_sizelimit = imageSize;
+}
+
+// Binds |target_fd| to the loop device |device_fd|. If the kernel supports
+// LOOP_CONFIGURE, the device is fully configured by this call and |configured|
+// is set to true. Returns false and leaves errno set on failure, in which case
+// the device isn't bound.
+bool bindLoopDevice(int device_fd, int target_fd, const int32_t imageOffset,
+                    const size_t imageSize, bool* configured) {
+  *configured = false;
+  if (!isLoopConfigureSupported(device_fd)) {
+    return ioctl(device_fd, LOOP_SET_FD, target_fd) != -1;
+  }
+
+  struct loop_config config;
+  memset(&config, 0, sizeof(config));
+  config.fd = target_fd;
+  // Direct-IO requires the loop device to have the same block size as the
+  // underlying filesystem. If the backing file doesn't support it, the kernel
+  // silently falls back to buffered IO.
+  config.block_size = 4096;
+  // The offset is in effect before the device can be read, so unlike with
+  // LOOP_SET_FD no stale pages end up in the buffer cache and BLKFLSBUF isn't
+  // needed (see configureLoopDevice()).
+  fillLoopInfo(imageOffset, imageSize, &config.info);
+  config.info.lo_flags = LO_FLAGS_DIRECT_IO;
+  if (ioctl(device_fd, LOOP_CONFIGURE, &config) == -1) {
+    return false;
+  }
+  *configured = true;
+  return true;
+}
+
+// Binds |target_fd| to a device from the pool. Returns false if the pool ran
+// out of free devices. Fails if a device can't be bound for another reason,
+// in which case that device goes back to the pool.
+StatusOr<bool> bindPooledLoopDevice(int target_fd, const int32_t imageOffset,
+                                    const size_t imageSize,
+                                    LoopbackDeviceUniqueFd* device_fd,
+                                    bool* configured) {
+  while (true) {
+    std::pair<unique_fd, std::string> pooled;
+    {
+      std::lock_guard<std::mutex> lock(gLoopPoolLock);
+      if (gLoopPool.empty()) {
+        return StatusOr<bool>(false);
+      }
+      pooled = std::move(gLoopPool.back());
+      gLoopPool.pop_back();
+    }
+    if (!bindLoopDevice(pooled.first.get(), target_fd, imageOffset, imageSize,
+                        configured)) {
+      if (errno == EBUSY) {
+        // Somebody else grabbed the device in the meantime.
+        PLOG(WARNING) << "Skipping pooled loop device " << pooled.second;
+        continue;
+      }
+      // The device is still free, and the next package might bind it.
+      Status status = Status::Fail(PStringLog() << "Failed to bind "
+                                                << pooled.second);
+      std::lock_guard<std::mutex> lock(gLoopPoolLock);
+      gLoopPool.push_back(std::move(pooled));
+      return StatusOr<bool>::MakeError(status);
+    }
+    *device_fd =
+        LoopbackDeviceUniqueFd(std::move(pooled.first), pooled.second);
+    return StatusOr<bool>(true);
+  }
+}
+
+// Applies the attributes of a loop device that was bound with LOOP_SET_FD.
+Status configureLoopDevice(int device_fd, const int32_t imageOffset,
+                           const size_t imageSize) {
+  struct loop_info64 li;
+  fillLoopInfo(imageOffset, imageSize, &li);
+  if (ioctl(device_fd, LOOP_SET_STATUS64, &li) == -1) {
+    return Status::Fail(PStringLog() << "Failed to LOOP_SET_STATUS64");
+  }
+
+  if (ioctl(device_fd, BLKFLSBUF, 0) == -1) {
+    // This works around a kernel bug where the following happens.
+    // 1) The device runs with a value of loop.max_part > 0
+    // 2) As part of LOOP_SET_FD, we do a partition scan, which loads
+    //    the first 2 pages of the underlying file into the buffer cache
+    // 3) When we then change the offset with LOOP_SET_STATUS64, those pages
+    //    are not invalidated from the cache.
+    // 4) When we try to mount an ext4 filesystem on the loop device, the ext4
+    //    code will try to find a superblock by reading 4k at offset 0; but,
+    //    because we still have the old pages at offset 0 lying in the cache,
+    //    those pages will be returned directly. However, those pages contain
+    //    the data at offset 0 in the underlying file, not at the offset that
+    //    we configured
+    // 5) the ext4 driver fails to find a superblock in the (wrong) data, and
+    //    fails to mount the filesystem.
+    //
+    // To work around this, explicitly flush the block device, which will flush
+    // the buffer cache and make sure we actually read the data at the correct
+    // offset.
+    return Status::Fail(PStringLog()
+                        << "Failed to flush buffers on the loop device");
+  }
+
+  // Direct-IO requires the loop device to have the same block size as the
+  // underlying filesystem.
+  if (ioctl(device_fd, LOOP_SET_BLOCK_SIZE, 4096) == -1) {
+    PLOG(WARNING) << "Failed to LOOP_SET_BLOCK_SIZE";
+  } else {
+    if (ioctl(device_fd, LOOP_SET_DIRECT_IO, 1) == -1) {
+      PLOG(WARNING) << "Failed to LOOP_SET_DIRECT_IO";
+      // TODO Eventually we'll want to fail on this; right now we can't because
+      // not all devices have the necessary kernel patches.
+    }
+  }
+
+  return Status::Success();
+}
+
+}  // namespace
 
 void LoopbackDeviceUniqueFd::MaybeCloseBad() {
   if (device_fd.get() != -1) {
@@ -118,101 +288,135 @@ Status preAllocateLoopDevices(size_t num) {
   // nodes will be done in parallel with other boot processes, and we
   // just optimistally hope that they are all created when we actually
   // access them for activating APEXes. If the dev nodes are not ready
-  // even then, we wait 50ms and warning message will be printed (see below
-  // createLoopDevice()).
+  // even then, createLoopDevice() waits for ueventd to create them.
   LOG(INFO) << "Pre-allocated " << num << " loopback devices";
   return Status::Success();
 }
 
-StatusOr<LoopbackDeviceUniqueFd> createLoopDevice(const std::string& target,
-                                                  const int32_t imageOffset,
-                                                  const size_t imageSize) {
-  using Failed = StatusOr<LoopbackDeviceUniqueFd>;
-  unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
+Status populateLoopDevicePool(size_t num) {
+  std::lock_guard<std::mutex> lock(gLoopPoolLock);
+  if (gLoopPool.size() >= num) {
+    return Status::Success();
+  }
+
+  unique_fd ctl_fd(
+      TEMP_FAILURE_RETRY(open("/dev/loop-control", O_RDWR | O_CLOEXEC)));
   if (ctl_fd.get() == -1) {
-    return Failed::MakeError(PStringLog() << "Failed to open loop-control");
+    return Status::Fail(PStringLog() << "Failed to open loop-control");
+  }
+  // All devices below the first free one are in use.
+  int first = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
+  if (first == -1) {
+    return Status::Fail(PStringLog() << "Failed LOOP_CTL_GET_FREE");
   }
 
-  int num = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
-  if (num == -1) {
-    return Failed::MakeError(PStringLog() << "Failed LOOP_CTL_GET_FREE");
+  std::unordered_set<std::string> pooled;
+  for (const auto& device : gLoopPool) {
+    pooled.insert(device.second);
   }
+  for (int id = first;
+       gLoopPool.size() < num && id < first + kMaxLoopDevicePoolScan; ++id) {
+    if (ioctl(ctl_fd.get(), LOOP_CTL_ADD, id) == -1 && errno != EEXIST) {
+      return Status::Fail(PStringLog() << "Failed LOOP_CTL_ADD");
+    }
+    std::string device = StringPrintf("/dev/block/loop%d", id);
+    if (pooled.count(device) != 0) {
+      continue;
+    }
+    // See comment on kLoopDeviceNodeTimeout.
+    Status nodeStatus = WaitForFile(device, kLoopDeviceNodeTimeout);
+    if (!nodeStatus.Ok()) {
+      // Leave the remaining devices to createLoopDevice().
+      LOG(WARNING) << nodeStatus.ErrorMessage();
+      break;
+    }
+    unique_fd device_fd(open(device.c_str(), O_RDWR | O_CLOEXEC));
+    if (device_fd.get() == -1) {
+      PLOG(WARNING) << "Failed to open " << device;
+      continue;
+    }
+    struct loop_info64 li;
+    if (ioctl(device_fd.get(), LOOP_GET_STATUS64, &li) == 0 || errno != ENXIO) {
+      // Already bound to a file.
+      continue;
+    }
+    gLoopPool.emplace_back(std::move(device_fd), device);
+  }
+  LOG(DEBUG) << "Loop device pool has " << gLoopPool.size() << " devices";
+  return Status::Success();
+}
+
+void releaseLoopDevicePool() {
+  std::lock_guard<std::mutex> lock(gLoopPoolLock);
+  if (!gLoopPool.empty()) {
+    LOG(DEBUG) << "Releasing " << gLoopPool.size() << " unused loop devices";
+  }
+  gLoopPool.clear();
+}
 
-  std::string device = StringPrintf("/dev/block/loop%d", num);
+StatusOr<LoopbackDeviceUniqueFd> createLoopDevice(const std::string& target,
+                                                  const int32_t imageOffset,
+                                                  const size_t imageSize) {
+  using Failed = StatusOr<LoopbackDeviceUniqueFd>;
 
   unique_fd target_fd(open(target.c_str(), O_RDONLY | O_CLOEXEC));
   if (target_fd.get() == -1) {
     return Failed::MakeError(PStringLog() << "Failed to open " << target);
   }
+
   LoopbackDeviceUniqueFd device_fd;
-  {
-    // See comment on kLoopDeviceRetryAttempts.
-    unique_fd sysfs_fd;
-    for (size_t i = 0; i != kLoopDeviceRetryAttempts; ++i) {
-      sysfs_fd.reset(open(device.c_str(), O_RDWR | O_CLOEXEC));
-      if (sysfs_fd.get() != -1) {
-        break;
-      }
-      PLOG(WARNING) << "Loopback device " << device
-                    << " not ready. Waiting 50ms...";
-      usleep(50000);
+  bool configured = false;
+  StatusOr<bool> pooled = bindPooledLoopDevice(
+      target_fd.get(), imageOffset, imageSize, &device_fd, &configured);
+  if (!pooled.Ok()) {
+    return Failed::MakeError(pooled.ErrorStatus());
+  }
+  if (!*pooled) {
+    // Packages can be activated concurrently. Hold the lock from picking a
+    // free device until it's bound to |target|, so that two threads don't
+    // race for the same device.
+    static std::mutex free_device_lock;
+    std::lock_guard<std::mutex> lock(free_device_lock);
+
+    unique_fd ctl_fd(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
+    if (ctl_fd.get() == -1) {
+      return Failed::MakeError(PStringLog() << "Failed to open loop-control");
     }
+
+    int num = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
+    if (num == -1) {
+      return Failed::MakeError(PStringLog() << "Failed LOOP_CTL_GET_FREE");
+    }
+
+    std::string device = StringPrintf("/dev/block/loop%d", num);
+    // See comment on kLoopDeviceNodeTimeout.
+    Status nodeStatus = WaitForFile(device, kLoopDeviceNodeTimeout);
+    if (!nodeStatus.Ok()) {
+      LOG(WARNING) << "Loopback device " << device << " not ready : "
+                   << nodeStatus.ErrorMessage();
+    }
+    unique_fd sysfs_fd(open(device.c_str(), O_RDWR | O_CLOEXEC));
     if (sysfs_fd.get() == -1) {
       return Failed::MakeError(PStringLog() << "Failed to open " << device);
     }
+
+    if (!bindLoopDevice(sysfs_fd.get(), target_fd.get(), imageOffset,
+                        imageSize, &configured)) {
+      return Failed::MakeError(PStringLog() << "Failed to bind " << device);
+    }
     device_fd = LoopbackDeviceUniqueFd(std::move(sysfs_fd), device);
     CHECK_NE(device_fd.get(), -1);
   }
 
-  if (ioctl(device_fd.get(), LOOP_SET_FD, target_fd.get()) == -1) {
-    return Failed::MakeError(PStringLog() << "Failed to LOOP_SET_FD");
-  }
-
-  struct loop_info64 li;
-  memset(&li, 0, sizeof(li));
-  strlcpy((char*)li.lo_crypt_name, kApexLoopIdPrefix, LO_NAME_SIZE);
-  li.lo_offset = imageOffset;
-  li.lo_sizelimit = imageSize;
-  if (ioctl(device_fd.get(), LOOP_SET_STATUS64, &li) == -1) {
-    return Failed::MakeError(PStringLog() << "Failed to LOOP_SET_STATUS64");
-  }
-
-  if (ioctl(device_fd.get(), BLKFLSBUF, 0) == -1) {
-    // This works around a kernel bug where the following happens.
-    // 1) The device runs with a value of loop.max_part > 0
-    // 2) As part of LOOP_SET_FD above, we do a partition scan, which loads
-    //    the first 2 pages of the underlying file into the buffer cache
-    // 3) When we then change the offset with LOOP_SET_STATUS64, those pages
-    //    are not invalidated from the cache.
-    // 4) When we try to mount an ext4 filesystem on the loop device, the ext4
-    //    code will try to find a superblock by reading 4k at offset 0; but,
-    //    because we still have the old pages at offset 0 lying in the cache,
-    //    those pages will be returned directly. However, those pages contain
-    //    the data at offset 0 in the underlying file, not at the offset that
-    //    we configured
-    // 5) the ext4 driver fails to find a superblock in the (wrong) data, and
-    //    fails to mount the filesystem.
-    //
-    // To work around this, explicitly flush the block device, which will flush
-    // the buffer cache and make sure we actually read the data at the correct
-    // offset.
-    return Failed::MakeError(PStringLog()
-                             << "Failed to flush buffers on the loop device");
-  }
-
-  // Direct-IO requires the loop device to have the same block size as the
-  // underlying filesystem.
-  if (ioctl(device_fd.get(), LOOP_SET_BLOCK_SIZE, 4096) == -1) {
-    PLOG(WARNING) << "Failed to LOOP_SET_BLOCK_SIZE";
-  } else {
-    if (ioctl(device_fd.get(), LOOP_SET_DIRECT_IO, 1) == -1) {
-      PLOG(WARNING) << "Failed to LOOP_SET_DIRECT_IO";
-      // TODO Eventually we'll want to fail on this; right now we can't because
-      // not all devices have the necessary kernel patches.
+  if (!configured) {
+    Status status = configureLoopDevice(device_fd.get(), imageOffset,
+                                        imageSize);
+    if (!status.Ok()) {
+      return Failed::MakeError(status.ErrorMessage());
     }
   }
 
-  Status readAheadStatus = configureReadAhead(device);
+  Status readAheadStatus = configureReadAhead(device_fd.name);
   if (!readAheadStatus.Ok()) {
     return Failed::MakeError(StringLog() << readAheadStatus.ErrorMessage());
   }
@@ -60,6 +60,15 @@ Status configureReadAhead(const std::string& device_path);
 
 Status preAllocateLoopDevices(size_t num);
 
+// Opens loop devices that aren't bound to any file yet until |num| of them are
+// kept open for createLoopDevice(), which then doesn't need to look for a free
+// device on its own.
+Status populateLoopDevicePool(size_t num);
+
+// Closes the devices that are still in the pool, e.g. because fewer packages
+// than estimated needed one.
+void releaseLoopDevicePool();
+
 StatusOr<LoopbackDeviceUniqueFd> createLoopDevice(const std::string& target,
                                                   const int32_t imageOffset,
                                                   const size_t imageSize);
@@ -24,6 +24,7 @@
 #include <android-base/logging.h>
 #include <android-base/macros.h>
 
+#include "apexd_backend.h"
 #include "string_log.h"
 
 namespace android {
@@ -73,7 +74,7 @@ Status BindMount(const std::string& target, const std::string& source) {
     };
     // Unmount any active bind-mount.
     if (exists) {
-      int rc = umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH);
+      int rc = GetActivationBackend().Unmount(target);
       if (rc != 0 && errno != EINVAL) {
         // Log error but ignore.
         PLOG(ERROR) << "Could not unmount " << target;
@@ -82,7 +83,7 @@ Status BindMount(const std::string& target, const std::string& source) {
   }
 
   LOG(VERBOSE) << "Bind-mounting " << source << " to " << target;
-  if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) == 0) {
+  if (GetActivationBackend().Mount(source, target, nullptr, MS_BIND) == 0) {
     return Status::Success();
   }
   return Status::Fail(PStringLog()
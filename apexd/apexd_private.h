@@ -26,6 +26,7 @@
 namespace android {
 namespace apex {
 
+class ActivationBackend;
 class ApexFile;
 
 static constexpr int kMkdirMode = 0755;
@@ -44,6 +45,13 @@ bool IsMounted(const std::string& name, const std::string& full_path);
 Status MountPackage(const ApexFile& apex, const std::string& mountPoint);
 Status UnmountPackage(const ApexFile& apex);
 
+// The backend set with setActivationBackend().
+ActivationBackend& GetActivationBackend();
+
+// Forgets all mounted packages without unmounting them, e.g. once a fake
+// backend dropped the packages it pretended to mount.
+void ForgetMountedApexes();
+
 }  // namespace apexd_private
 }  // namespace apex
 }  // namespace android
@@ -22,14 +22,25 @@
 
 #include "session_state.pb.h"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/unique_fd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <set>
 
+using android::base::unique_fd;
+using apex::proto::SessionJournalRecord;
 using apex::proto::SessionState;
 
 namespace android {
@@ -37,34 +48,25 @@ namespace apex {
 
 namespace {
 
+// Sessions used to be stored in /data/apex/sessions/<id>/state. These are
+// migrated to the journal the first time it is written.
 static constexpr const char* kStateFileName = "state";
-
-std::string getSessionDir(int session_id) {
-  return kApexSessionsDir + "/" + std::to_string(session_id);
-}
-
-std::string getSessionStateFilePath(int session_id) {
-  return getSessionDir(session_id) + "/" + kStateFileName;
+static constexpr const char* kJournalFileName = "journal";
+static constexpr const char* kLockFileName = "journal.lock";
+// The journal is compacted once it has this many more records than there are
+// sessions.
+static constexpr size_t kCompactionSlack = 64;
+
+std::string getSessionDir(const std::string& sessions_dir, int session_id) {
+  return sessions_dir + "/" + std::to_string(session_id);
 }
 
-StatusOr<std::string> createSessionDirIfNeeded(int session_id) {
-  // create /data/sessions
-  auto res = createDirIfNeeded(kApexSessionsDir, 0700);
-  if (!res.Ok()) {
-    return StatusOr<std::string>(res.ErrorMessage());
-  }
-  // create /data/sessions/session_id
-  std::string sessionDir = getSessionDir(session_id);
-  res = createDirIfNeeded(sessionDir, 0700);
-  if (!res.Ok()) {
-    return StatusOr<std::string>(res.ErrorMessage());
-  }
-
-  return StatusOr<std::string>(sessionDir);
+std::string getJournalPath(const std::string& sessions_dir) {
+  return sessions_dir + "/" + kJournalFileName;
 }
 
-Status deleteSessionDir(int session_id) {
-  std::string session_dir = getSessionDir(session_id);
+Status deleteSessionDir(const std::string& sessions_dir, int session_id) {
+  std::string session_dir = getSessionDir(sessions_dir, session_id);
   LOG(DEBUG) << "Deleting " << session_dir;
   auto path = std::filesystem::path(session_dir);
   std::error_code error_code;
@@ -76,91 +78,488 @@ Status deleteSessionDir(int session_id) {
   return Status::Success();
 }
 
+StatusOr<SessionState> readLegacyStateFile(const std::string& path) {
+  SessionState state;
+  std::fstream stateFile(path, std::ios::in | std::ios::binary);
+  if (!stateFile) {
+    return StatusOr<SessionState>::MakeError("Failed to open " + path);
+  }
+
+  if (!state.ParseFromIstream(&stateFile)) {
+    return StatusOr<SessionState>::MakeError("Failed to parse " + path);
+  }
+
+  return StatusOr<SessionState>(std::move(state));
+}
+
+// Each journal record is a header followed by a serialized
+// SessionJournalRecord of |size| bytes whose CRC-32 is |crc|. The journal
+// never leaves the device, so the header uses the native byte order.
+struct RecordHeader {
+  uint32_t size;
+  uint32_t crc;
+};
+
+uint32_t computeCrc(const std::string& data) {
+  return crc32(crc32(0L, Z_NULL, 0),
+               reinterpret_cast<const Bytef*>(data.data()), data.size());
+}
+
+void appendRecord(const SessionJournalRecord& record, std::string* out) {
+  std::string payload;
+  record.SerializeToString(&payload);
+  RecordHeader header = {static_cast<uint32_t>(payload.size()),
+                         computeCrc(payload)};
+  out->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  out->append(payload);
+}
+
+// In-memory copy of all sessions in |dir|, indexed by id and by state, and
+// kept in sync with the journal. Other processes (e.g. tests) may write the
+// journal too, so it is checked for changes on every access; that costs a
+// stat() and, only if something changed, reading the new records.
+class SessionStore {
+ public:
+  explicit SessionStore(const std::string& dir) : dir_(dir) {}
+
+  static SessionStore& GetInstance() {
+    static SessionStore instance(kApexSessionsDir);
+    return instance;
+  }
+
+  StatusOr<SessionState> Get(int session_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Refresh();
+    auto it = sessions_.find(session_id);
+    if (it == sessions_.end()) {
+      return StatusOr<SessionState>::MakeError(
+          StringLog() << "Failed to find session " << session_id);
+    }
+    return StatusOr<SessionState>(it->second);
+  }
+
+  std::vector<SessionState> GetAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Refresh();
+    std::vector<SessionState> ret;
+    ret.reserve(sessions_.size());
+    for (const auto& it : sessions_) {
+      ret.push_back(it.second);
+    }
+    return ret;
+  }
+
+  std::vector<SessionState> GetInStates(
+      const std::vector<SessionState::State>& states) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Refresh();
+    std::vector<SessionState> ret;
+    for (SessionState::State state : states) {
+      auto ids = by_state_.find(state);
+      if (ids == by_state_.end()) {
+        continue;
+      }
+      for (int id : ids->second) {
+        ret.push_back(sessions_.at(id));
+      }
+    }
+    return ret;
+  }
+
+  // Returns a counter that changes whenever the sessions do, including when
+  // they're changed by another process.
+  uint64_t GetGeneration() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Refresh();
+    return generation_;
+  }
+
+  Status Put(const SessionState& state) {
+    SessionJournalRecord record;
+    *record.mutable_update() = state;
+    return Commit(record);
+  }
+
+  Status Delete(int session_id) {
+    SessionJournalRecord record;
+    record.set_deleted_id(session_id);
+    return Commit(record);
+  }
+
+  // Moves the sessions from the legacy state files, if any, to the journal.
+  Status MigrateLegacySessions() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (access(dir_.c_str(), F_OK) != 0) {
+      // Nothing to migrate.
+      return Status::Success();
+    }
+    StatusOr<unique_fd> lock_fd = LockJournal();
+    if (!lock_fd.Ok()) {
+      return lock_fd.ErrorStatus();
+    }
+    RefreshLocked();
+    if (journal_exists_) {
+      return Status::Success();
+    }
+    return MigrateLegacySessionsLocked();
+  }
+
+ private:
+  void Apply(const SessionJournalRecord& record) {
+    int id = record.has_update() ? record.update().id() : record.deleted_id();
+    auto it = sessions_.find(id);
+    if (it != sessions_.end()) {
+      auto ids = by_state_.find(it->second.state());
+      ids->second.erase(id);
+      if (ids->second.empty()) {
+        by_state_.erase(ids);
+      }
+      sessions_.erase(it);
+    }
+    if (record.has_update()) {
+      by_state_[record.update().state()].insert(id);
+      sessions_.emplace(id, record.update());
+    }
+    generation_++;
+  }
+
+  void Reset() {
+    if (!sessions_.empty()) {
+      generation_++;
+    }
+    sessions_.clear();
+    by_state_.clear();
+    journal_exists_ = false;
+    legacy_loaded_ = false;
+    dev_ = 0;
+    ino_ = 0;
+    offset_ = 0;
+    num_records_ = 0;
+  }
+
+  // Sessions that haven't been migrated to the journal yet.
+  void LoadLegacySessions() {
+    auto sessionPaths =
+        ReadDir(dir_, [](const std::filesystem::directory_entry& entry) {
+          std::error_code ec;
+          return entry.is_directory(ec);
+        });
+    if (!sessionPaths.Ok()) {
+      return;
+    }
+    for (const std::string& sessionDirPath : *sessionPaths) {
+      auto state = readLegacyStateFile(sessionDirPath + "/" + kStateFileName);
+      if (!state.Ok()) {
+        LOG(WARNING) << state.ErrorMessage();
+        continue;
+      }
+      SessionJournalRecord record;
+      *record.mutable_update() = std::move(*state);
+      Apply(record);
+    }
+  }
+
+  // Brings the in-memory sessions up to date with the journal. Records are
+  // read up to the first one that is incomplete or corrupted, e.g. because
+  // writing it was interrupted. Must be called with |mutex_| held.
+  void Refresh() {
+    const std::string journal = getJournalPath(dir_);
+    struct stat st;
+    if (stat(journal.c_str(), &st) != 0) {
+      if (errno != ENOENT) {
+        PLOG(ERROR) << "Failed to stat " << journal;
+        return;
+      }
+      if (!journal_exists_ && legacy_loaded_) {
+        // The legacy state files are only read once, as only an older apexd
+        // writes them. MigrateLegacySessions() and Commit() read them again
+        // before moving them to the journal.
+        return;
+      }
+      // No journal (anymore), e.g. because the sessions were wiped.
+      Reset();
+      LoadLegacySessions();
+      legacy_loaded_ = true;
+      return;
+    }
+    if (journal_exists_ && st.st_dev == dev_ && st.st_ino == ino_ &&
+        st.st_size == offset_) {
+      return;
+    }
+
+    unique_fd fd(open(journal.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() == -1 || fstat(fd.get(), &st) != 0) {
+      PLOG(ERROR) << "Failed to open " << journal;
+      return;
+    }
+    if (!journal_exists_ || st.st_dev != dev_ || st.st_ino != ino_ ||
+        st.st_size < offset_) {
+      // A different journal, e.g. after compaction. Start over.
+      Reset();
+      journal_exists_ = true;
+      dev_ = st.st_dev;
+      ino_ = st.st_ino;
+    }
+
+    std::string data(st.st_size - offset_, '\0');
+    if (!android::base::ReadFullyAtOffset(fd.get(), data.data(), data.size(),
+                                          offset_)) {
+      PLOG(ERROR) << "Failed to read " << journal;
+      return;
+    }
+    size_t pos = 0;
+    while (pos + sizeof(RecordHeader) <= data.size()) {
+      RecordHeader header;
+      memcpy(&header, data.data() + pos, sizeof(header));
+      if (header.size > data.size() - pos - sizeof(header)) {
+        break;
+      }
+      std::string payload = data.substr(pos + sizeof(header), header.size);
+      SessionJournalRecord record;
+      if (computeCrc(payload) != header.crc ||
+          !record.ParseFromString(payload)) {
+        LOG(WARNING) << "Ignoring corrupted tail of " << journal
+                     << " at offset " << offset_ + pos;
+        break;
+      }
+      Apply(record);
+      pos += sizeof(header) + header.size;
+      num_records_++;
+    }
+    offset_ += pos;
+  }
+
+  // Replaces the journal with one that only holds the current sessions.
+  // Must be called with |mutex_| and the journal lock held.
+  Status Compact() {
+    std::string data;
+    for (const auto& it : sessions_) {
+      SessionJournalRecord record;
+      *record.mutable_update() = it.second;
+      appendRecord(record, &data);
+    }
+
+    const std::string journal = getJournalPath(dir_);
+    const std::string tmp = journal + ".tmp";
+    unique_fd fd(open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0600));
+    if (fd.get() == -1) {
+      return Status::Fail(PStringLog() << "Failed to open " << tmp);
+    }
+    struct stat st;
+    if (!android::base::WriteFully(fd.get(), data.data(), data.size()) ||
+        fsync(fd.get()) != 0 || fstat(fd.get(), &st) != 0) {
+      return Status::Fail(PStringLog() << "Failed to write " << tmp);
+    }
+    if (rename(tmp.c_str(), journal.c_str()) != 0) {
+      return Status::Fail(PStringLog() << "Failed to rename " << tmp);
+    }
+    Status status = FsyncDir(dir_);
+    if (!status.Ok()) {
+      return status;
+    }
+    journal_exists_ = true;
+    dev_ = st.st_dev;
+    ino_ = st.st_ino;
+    offset_ = st.st_size;
+    num_records_ = sessions_.size();
+    return Status::Success();
+  }
+
+  // Takes the lock that serializes writers of the journal across processes.
+  // A separate file is locked, as the journal itself is replaced on
+  // compaction.
+  StatusOr<unique_fd> LockJournal() {
+    auto status = createDirIfNeeded(dir_, 0700);
+    if (!status.Ok()) {
+      return StatusOr<unique_fd>::MakeError(status);
+    }
+    const std::string lock_path = dir_ + "/" + kLockFileName;
+    unique_fd lock_fd(
+        open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+    if (lock_fd.get() == -1 || flock(lock_fd.get(), LOCK_EX) != 0) {
+      return StatusOr<unique_fd>::MakeError(PStringLog() << "Failed to lock "
+                                                         << lock_path);
+    }
+    return StatusOr<unique_fd>(std::move(lock_fd));
+  }
+
+  // Brings the in-memory sessions up to date while the journal lock is held,
+  // reading the legacy state files again if there is no journal.
+  void RefreshLocked() {
+    legacy_loaded_ = false;
+    Refresh();
+  }
+
+  // Writes the sessions loaded from the legacy state files, if any, to a new
+  // journal and deletes the state files. Must be called with |mutex_| and the
+  // journal lock held, after Refresh() found no journal.
+  Status MigrateLegacySessionsLocked() {
+    std::vector<int> legacy_ids;
+    for (const auto& it : sessions_) {
+      legacy_ids.push_back(it.first);
+    }
+    auto status = Compact();
+    if (!status.Ok()) {
+      return status;
+    }
+    for (int id : legacy_ids) {
+      status = deleteSessionDir(dir_, id);
+      if (!status.Ok()) {
+        LOG(WARNING) << status.ErrorMessage();
+      }
+    }
+    return Status::Success();
+  }
+
+  // Durably appends |record| to the journal and applies it.
+  Status Commit(const SessionJournalRecord& record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    StatusOr<unique_fd> lock_fd = LockJournal();
+    if (!lock_fd.Ok()) {
+      return lock_fd.ErrorStatus();
+    }
+    RefreshLocked();
+
+    Status status;
+    if (!journal_exists_) {
+      status = MigrateLegacySessionsLocked();
+      if (!status.Ok()) {
+        return status;
+      }
+    }
+
+    const std::string journal = getJournalPath(dir_);
+    unique_fd fd(open(journal.c_str(), O_WRONLY | O_CLOEXEC));
+    if (fd.get() == -1) {
+      return Status::Fail(PStringLog() << "Failed to open " << journal);
+    }
+    // Drops the tail of an interrupted write, if any.
+    if (ftruncate(fd.get(), offset_) != 0) {
+      return Status::Fail(PStringLog() << "Failed to truncate " << journal);
+    }
+    std::string data;
+    appendRecord(record, &data);
+    if (lseek(fd.get(), offset_, SEEK_SET) != offset_ ||
+        !android::base::WriteFully(fd.get(), data.data(), data.size()) ||
+        fsync(fd.get()) != 0) {
+      return Status::Fail(PStringLog() << "Failed to write " << journal);
+    }
+    Apply(record);
+    offset_ += data.size();
+    num_records_++;
+
+    if (num_records_ > sessions_.size() + kCompactionSlack) {
+      status = Compact();
+      if (!status.Ok()) {
+        // The journal is still valid, just longer than it needs to be.
+        LOG(WARNING) << "Failed to compact " << journal << " : "
+                     << status.ErrorMessage();
+      }
+    }
+    return Status::Success();
+  }
+
+  const std::string dir_;
+  std::mutex mutex_;
+  std::map<int, SessionState> sessions_;
+  std::map<SessionState::State, std::set<int>> by_state_;
+  // Identity of the journal that was read, and how many bytes and valid
+  // records of it have been applied.
+  bool journal_exists_ = false;
+  dev_t dev_ = 0;
+  ino_t ino_ = 0;
+  off_t offset_ = 0;
+  size_t num_records_ = 0;
+  uint64_t generation_ = 0;
+  // Whether the legacy state files were read since there is no journal.
+  bool legacy_loaded_ = false;
+};
+
 }  // namespace
 
 ApexSession::ApexSession(const SessionState& state) : state_(state) {}
 
 StatusOr<ApexSession> ApexSession::CreateSession(int session_id) {
   SessionState state;
-  // Create session directory
-  auto sessionPath = createSessionDirIfNeeded(session_id);
-  if (!sessionPath.Ok()) {
-    return StatusOr<ApexSession>::MakeError(sessionPath.ErrorMessage());
+  // Make sure the sessions can be committed.
+  auto res = createDirIfNeeded(kApexSessionsDir, 0700);
+  if (!res.Ok()) {
+    return StatusOr<ApexSession>::MakeError(res.ErrorMessage());
   }
   state.set_id(session_id);
   ApexSession session(state);
 
   return StatusOr<ApexSession>(std::move(session));
 }
-StatusOr<ApexSession> ApexSession::GetSessionFromFile(const std::string& path) {
-  SessionState state;
-  std::fstream stateFile(path, std::ios::in | std::ios::binary);
-  if (!stateFile) {
-    return StatusOr<ApexSession>::MakeError("Failed to open " + path);
-  }
-
-  if (!state.ParseFromIstream(&stateFile)) {
-    return StatusOr<ApexSession>::MakeError("Failed to parse " + path);
-  }
-
-  return StatusOr<ApexSession>(ApexSession(state));
-}
 
 StatusOr<ApexSession> ApexSession::GetSession(int session_id) {
-  auto path = getSessionStateFilePath(session_id);
-
-  return GetSessionFromFile(path);
+  auto state = SessionStore::GetInstance().Get(session_id);
+  if (!state.Ok()) {
+    return StatusOr<ApexSession>::MakeError(state.ErrorStatus());
+  }
+  return StatusOr<ApexSession>(ApexSession(*state));
 }
 
 std::vector<ApexSession> ApexSession::GetSessions() {
   std::vector<ApexSession> sessions;
-
-  StatusOr<std::vector<std::string>> sessionPaths = ReadDir(
-      kApexSessionsDir, [](const std::filesystem::directory_entry& entry) {
-        std::error_code ec;
-        return entry.is_directory(ec);
-      });
-
-  if (!sessionPaths.Ok()) {
-    return sessions;
+  for (const SessionState& state : SessionStore::GetInstance().GetAll()) {
+    sessions.push_back(ApexSession(state));
   }
+  return sessions;
+}
 
-  for (const std::string& sessionDirPath : *sessionPaths) {
-    // Try to read session state
-    auto session = GetSessionFromFile(sessionDirPath + "/" + kStateFileName);
-    if (!session.Ok()) {
-      LOG(WARNING) << session.ErrorMessage();
-      continue;
-    }
-    sessions.push_back(std::move(*session));
+std::vector<ApexSession> ApexSession::LoadSessionsFromDir(
+    const std::string& sessions_dir) {
+  SessionStore store(sessions_dir);
+  Status status = store.MigrateLegacySessions();
+  if (!status.Ok()) {
+    LOG(WARNING) << status.ErrorMessage();
+  }
+  std::vector<ApexSession> sessions;
+  for (const SessionState& state : store.GetAll()) {
+    sessions.push_back(ApexSession(state));
   }
-
   return sessions;
 }
 
+Status ApexSession::MigrateLegacySessions() {
+  return SessionStore::GetInstance().MigrateLegacySessions();
+}
+
+uint64_t ApexSession::GetSessionsGeneration() {
+  return SessionStore::GetInstance().GetGeneration();
+}
+
 std::vector<ApexSession> ApexSession::GetSessionsInState(
     SessionState::State state) {
-  auto sessions = GetSessions();
-  sessions.erase(
-      std::remove_if(sessions.begin(), sessions.end(),
-                     [&](const ApexSession &s) { return s.GetState() != state; }),
-      sessions.end());
-
+  std::vector<ApexSession> sessions;
+  auto states = SessionStore::GetInstance().GetInStates({state});
+  for (const SessionState& s : states) {
+    sessions.push_back(ApexSession(s));
+  }
   return sessions;
 }
 
 StatusOr<std::optional<ApexSession>> ApexSession::GetActiveSession() {
-  auto sessions = GetSessions();
-  std::optional<ApexSession> ret = std::nullopt;
-  for (const ApexSession& session : sessions) {
-    if (!session.IsFinalized()) {
-      if (ret) {
-        return StatusOr<std::optional<ApexSession>>::MakeError(
-            "More than one active session");
-      }
-      ret.emplace(session);
+  std::vector<SessionState::State> active_states;
+  for (int state = SessionState::State_MIN; state <= SessionState::State_MAX;
+       state++) {
+    SessionState s;
+    s.set_state(static_cast<SessionState::State>(state));
+    if (SessionState::State_IsValid(state) && !ApexSession(s).IsFinalized()) {
+      active_states.push_back(s.state());
     }
   }
+  auto sessions = SessionStore::GetInstance().GetInStates(active_states);
+  if (sessions.size() > 1) {
+    return StatusOr<std::optional<ApexSession>>::MakeError(
+        "More than one active session");
+  }
+  std::optional<ApexSession> ret = std::nullopt;
+  if (!sessions.empty()) {
+    ret.emplace(ApexSession(sessions[0]));
+  }
   return StatusOr<std::optional<ApexSession>>(std::move(ret));
 }
 
@@ -197,19 +596,12 @@ void ApexSession::SetChildSessionIds(
 Status ApexSession::UpdateStateAndCommit(
     const SessionState::State& session_state) {
   state_.set_state(session_state);
-
-  auto stateFilePath = getSessionStateFilePath(state_.id());
-
-  std::fstream stateFile(stateFilePath,
-                         std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!state_.SerializeToOstream(&stateFile)) {
-    return Status::Fail("Failed to write state file " + stateFilePath);
-  }
-
-  return Status::Success();
+  return SessionStore::GetInstance().Put(state_);
 }
 
-Status ApexSession::DeleteSession() const { return deleteSessionDir(GetId()); }
+Status ApexSession::DeleteSession() const {
+  return SessionStore::GetInstance().Delete(GetId());
+}
 
 std::ostream& operator<<(std::ostream& out, const ApexSession& session) {
   return out << "[id = " << session.GetId()
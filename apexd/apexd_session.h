@@ -35,9 +35,20 @@ class ApexSession {
   static StatusOr<ApexSession> CreateSession(int session_id);
   static StatusOr<ApexSession> GetSession(int session_id);
   static std::vector<ApexSession> GetSessions();
+  // Reads the sessions stored in |sessions_dir| from scratch, after migrating
+  // legacy state files like MigrateLegacySessions() does. Used to benchmark
+  // loading them.
+  static std::vector<ApexSession> LoadSessionsFromDir(
+      const std::string& sessions_dir);
   static std::vector<ApexSession> GetSessionsInState(
       ::apex::proto::SessionState::State state);
   static StatusOr<std::optional<ApexSession>> GetActiveSession();
+  // Moves sessions stored by older versions of apexd to the journal, and
+  // deletes their state files. Reading sessions never writes anything, so
+  // this is done once on start.
+  static Status MigrateLegacySessions();
+  // Changes whenever any session is created, updated or deleted.
+  static uint64_t GetSessionsGeneration();
   ApexSession() = delete;
 
   const google::protobuf::RepeatedField<int> GetChildSessionIds() const;
@@ -53,8 +64,6 @@ class ApexSession {
  private:
   ApexSession(const ::apex::proto::SessionState& state);
   ::apex::proto::SessionState state_;
-
-  static StatusOr<ApexSession> GetSessionFromFile(const std::string& path);
 };
 
 std::ostream& operator<<(std::ostream& out, const ApexSession& session);
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_trace.h"
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+#include <android-base/stringprintf.h>
+#include <cutils/trace.h>
+
+using android::base::StringAppendF;
+
+namespace android {
+namespace apex {
+namespace trace {
+
+namespace {
+
+// Keeps memory bounded if apexd is asked to (de)activate packages over and
+// over again after boot.
+static constexpr size_t kMaxTimelineEntries = 1024;
+
+// All offsets in the dump are relative to this point, which is roughly when
+// apexd started.
+const Clock::time_point gProcessStart = Clock::now();
+
+std::mutex gTimelineLock;
+std::deque<TimelineEntry> gTimeline;
+
+}  // namespace
+
+const char* PhaseName(Phase phase) {
+  switch (phase) {
+    case Phase::kOpen:
+      return "open";
+    case Phase::kVerify:
+      return "verify";
+    case Phase::kLoopSetup:
+      return "loop";
+    case Phase::kDmCreate:
+      return "dm";
+    case Phase::kDeviceWait:
+      return "wait";
+    case Phase::kMount:
+      return "mount";
+    case Phase::kBindMount:
+      return "bind";
+    case Phase::kScan:
+      return "scan";
+    case Phase::kStartup:
+      return "startup";
+  }
+  return "unknown";
+}
+
+ScopedPhase::ScopedPhase(Phase phase, const std::string& subject)
+    : phase_(phase), subject_(subject), start_(Clock::now()) {
+  if (ATRACE_ENABLED()) {
+    std::string name = std::string(PhaseName(phase_)) + " " + subject_;
+    ATRACE_BEGIN(name.c_str());
+  }
+}
+
+ScopedPhase::~ScopedPhase() {
+  if (ATRACE_ENABLED()) {
+    ATRACE_END();
+  }
+  Record(phase_, subject_, start_, Clock::now());
+}
+
+void Record(Phase phase, const std::string& subject, Clock::time_point start,
+            Clock::time_point end) {
+  std::lock_guard<std::mutex> lock(gTimelineLock);
+  if (gTimeline.size() >= kMaxTimelineEntries) {
+    gTimeline.pop_front();
+  }
+  gTimeline.push_back(TimelineEntry{subject, phase, start, end - start});
+}
+
+std::vector<TimelineEntry> GetTimeline() {
+  std::vector<TimelineEntry> timeline;
+  {
+    std::lock_guard<std::mutex> lock(gTimelineLock);
+    timeline.assign(gTimeline.begin(), gTimeline.end());
+  }
+  std::stable_sort(timeline.begin(), timeline.end(),
+                   [](const TimelineEntry& a, const TimelineEntry& b) {
+                     return a.start < b.start;
+                   });
+  return timeline;
+}
+
+std::string DumpTimeline() {
+  using std::chrono::duration;
+  using Millis = duration<double, std::milli>;
+
+  std::string out;
+  for (const TimelineEntry& entry : GetTimeline()) {
+    StringAppendF(&out, "  +%10.3fms %9.3fms %-7s %s\n",
+                  Millis(entry.start - gProcessStart).count(),
+                  Millis(entry.duration).count(), PhaseName(entry.phase),
+                  entry.subject.c_str());
+  }
+  return out;
+}
+
+}  // namespace trace
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_TRACE_H_
+#define ANDROID_APEXD_APEXD_TRACE_H_
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+namespace trace {
+
+// Steps of activating a package that are worth timing individually, plus the
+// coarse stages of a boot they are part of.
+enum class Phase {
+  kOpen,        // Parsing the APEX archive.
+  kVerify,      // Verifying the vbmeta signature.
+  kLoopSetup,   // Creating and configuring the loop device.
+  kDmCreate,    // Creating the dm-verity device.
+  kDeviceWait,  // Waiting for ueventd to create the block device node.
+  kMount,       // Mounting the payload and verifying its manifest.
+  kBindMount,   // Bind-mounting the package to /apex/<name>.
+  kScan,        // Activating all packages of a directory.
+  kStartup,     // onBootstrap() or onStart().
+};
+
+const char* PhaseName(Phase phase);
+
+using Clock = std::chrono::steady_clock;
+
+struct TimelineEntry {
+  std::string subject;  // Package path, directory or stage name.
+  Phase phase;
+  Clock::time_point start;
+  Clock::duration duration;
+};
+
+// Emits an atrace section for |phase| of |subject| and records it in the
+// timeline when it goes out of scope.
+class ScopedPhase {
+ public:
+  ScopedPhase(Phase phase, const std::string& subject);
+  ~ScopedPhase();
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+ private:
+  Phase phase_;
+  std::string subject_;
+  Clock::time_point start_;
+};
+
+// Records an already measured phase in the timeline, without an atrace
+// section.
+void Record(Phase phase, const std::string& subject, Clock::time_point start,
+            Clock::time_point end);
+
+// Returns the recorded timeline, ordered by start time.
+std::vector<TimelineEntry> GetTimeline();
+
+// Formats the timeline for dumpsys and the shell command.
+std::string DumpTimeline();
+
+}  // namespace trace
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_TRACE_H_
@@ -17,19 +17,31 @@
 #ifndef ANDROID_APEXD_APEXD_UTILS_H_
 #define ANDROID_APEXD_APEXD_UTILS_H_
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include <android-base/chrono_utils.h>
 #include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <cutils/android_reboot.h>
 
 #include "status_or.h"
@@ -178,30 +190,183 @@ inline StatusOr<bool> PathExists(const std::string& path) {
   return Status(true);
 }
 
+// Makes the entries of directory |path| durable.
+inline Status FsyncDir(const std::string& path) {
+  android::base::unique_fd fd(
+      open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (fd.get() == -1 || fsync(fd.get()) != 0) {
+    return Status::Fail(PStringLog() << "Failed to sync " << path);
+  }
+  return Status::Success();
+}
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+// Atomically exchanges |a| and |b|, which must both exist. Returns false and
+// leaves errno set on failure; in particular to ENOSYS or EINVAL if the kernel
+// or the filesystem doesn't support it.
+inline bool ExchangePaths(const std::string& a, const std::string& b) {
+  return syscall(SYS_renameat2, AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(),
+                 RENAME_EXCHANGE) == 0;
+}
+
+// Identifies the contents of a file on disk. Replacing the file or writing
+// to it changes at least one of the fields; ctime also catches writes that
+// restore the previous mtime.
+struct FileIdentity {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+
+  static FileIdentity FromStat(const struct stat& st) {
+    return {st.st_dev, st.st_ino, st.st_size,
+            st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+            st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec};
+  }
+
+  bool operator==(const FileIdentity& other) const {
+    return std::tie(dev, ino, size, mtime_ns, ctime_ns) ==
+           std::tie(other.dev, other.ino, other.size, other.mtime_ns,
+                    other.ctime_ns);
+  }
+  bool operator!=(const FileIdentity& other) const {
+    return !(*this == other);
+  }
+  bool operator<(const FileIdentity& other) const {
+    return std::tie(dev, ino, size, mtime_ns, ctime_ns) <
+           std::tie(other.dev, other.ino, other.size, other.mtime_ns,
+                    other.ctime_ns);
+  }
+};
+
+// Returns |bytes| as a lowercase hex string.
+inline std::string BytesToHex(std::string_view bytes) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string hex(bytes.size() * 2, '\0');
+  for (size_t i = 0; i < bytes.size(); i++) {
+    const uint8_t byte = static_cast<uint8_t>(bytes[i]);
+    hex[2 * i] = kHexDigits[byte >> 4];
+    hex[2 * i + 1] = kHexDigits[byte & 0xf];
+  }
+  return hex;
+}
+
 inline void Reboot() {
   LOG(INFO) << "Rebooting device";
+#ifdef __ANDROID__
   if (android_reboot(ANDROID_RB_RESTART2, 0, nullptr) != 0) {
     LOG(ERROR) << "Failed to reboot device";
   }
+#else
+  LOG(ERROR) << "Can't reboot the host";
+#endif
 }
 
-inline Status WaitForFile(const std::string& path,
-                          std::chrono::nanoseconds timeout) {
+// Calls |fn(i)| for every i in [0, count) using at most |max_threads| threads,
+// including the calling one. Returns once all calls have completed.
+template <typename Fn>
+void ForEachInParallel(size_t count, size_t max_threads, const Fn& fn) {
+  const size_t num_threads = std::min(count, std::max<size_t>(max_threads, 1));
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Waits until all of |paths| exist (or, if |exists| is false, until none of
+// them exists anymore), or |timeout| expires. Instead of polling, this sleeps
+// on inotify watches of the parent directories, so the caller is woken up as
+// soon as e.g. ueventd creates or removes a device node.
+inline Status WaitForPaths(const std::vector<std::string>& paths, bool exists,
+                           std::chrono::nanoseconds timeout) {
   android::base::Timer t;
+  android::base::unique_fd inotify_fd(
+      inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+  for (const std::string& path : paths) {
+    const std::string dir = std::filesystem::path(path).parent_path();
+    // Watching the same directory twice just returns the existing watch.
+    if (inotify_fd.get() != -1 &&
+        inotify_add_watch(inotify_fd.get(), dir.c_str(),
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                              IN_MOVED_TO) == -1) {
+      // Parent directory doesn't exist (yet); fall back to polling.
+      inotify_fd.reset();
+    }
+  }
+
   bool has_slept = false;
-  while (t.duration() < timeout) {
-    struct stat sb;
-    if (stat(path.c_str(), &sb) != -1) {
+  std::vector<std::string> pending = paths;
+  while (true) {
+    // Checked after the watches are set up, so that no event is missed.
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                 [exists](const std::string& path) {
+                                   struct stat sb;
+                                   return (stat(path.c_str(), &sb) == 0) ==
+                                          exists;
+                                 }),
+                  pending.end());
+    if (pending.empty()) {
       if (has_slept) {
-        LOG(INFO) << "wait for '" << path << "' took " << t;
+        LOG(INFO) << "wait for '" << android::base::Join(paths, "', '")
+                  << "' took " << t;
       }
       return Status::Success();
     }
-    std::this_thread::sleep_for(5ms);
+    auto remaining = timeout - t.duration();
+    if (remaining <= std::chrono::nanoseconds::zero()) {
+      break;
+    }
     has_slept = true;
+    if (inotify_fd.get() == -1) {
+      std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(
+          remaining, std::chrono::milliseconds(5)));
+      continue;
+    }
+    struct pollfd pfd = {inotify_fd.get(), POLLIN, 0};
+    auto remaining_ms =
+        std::chrono::ceil<std::chrono::milliseconds>(remaining).count();
+    if (TEMP_FAILURE_RETRY(poll(&pfd, 1, remaining_ms)) > 0) {
+      // Drain the queued events; the condition is re-checked with stat().
+      char buf[4096];
+      while (read(inotify_fd.get(), buf, sizeof(buf)) > 0) {
+      }
+    }
   }
   return Status::Fail(PStringLog()
-                      << "wait for '" << path << "' timed out and took " << t);
+                      << "wait for '" << android::base::Join(pending, "', '")
+                      << "' timed out and took " << t);
+}
+
+inline Status WaitForPath(const std::string& path, bool exists,
+                          std::chrono::nanoseconds timeout) {
+  return WaitForPaths({path}, exists, timeout);
+}
+
+inline Status WaitForFile(const std::string& path,
+                          std::chrono::nanoseconds timeout) {
+  return WaitForPath(path, /* exists = */ true, timeout);
 }
 
 }  // namespace apex
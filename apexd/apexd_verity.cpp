@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "apexd"
+
+#include "apexd_verity.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <libavb/libavb.h>
+#include <openssl/digest.h>
+#include <verity/hash_tree_builder.h>
+
+#include "apexd_utils.h"
+#include "status_or.h"
+#include "string_log.h"
+
+using android::base::ReadFullyAtOffset;
+using android::base::unique_fd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// How much of the image is read at a time to generate its hashtree. A
+// multiple of the block size.
+static constexpr size_t kHashTreeReadSize = 1024 * 1024;
+
+bool isRootDigest(const uint8_t* digest, size_t size,
+                  const ApexVerityData& verity_data) {
+  return std::string_view(reinterpret_cast<const char*>(digest), size) ==
+         verity_data.root_digest;
+}
+
+// Returns true if |fd| holds the hashtree of |verity_data|. The top level of
+// a hashtree is the first block of it, and hashes to the root digest.
+bool matchesRootDigest(int fd, const ApexVerityData& verity_data,
+                       const EVP_MD* md, uint64_t tree_size) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != tree_size) {
+    return false;
+  }
+  std::vector<uint8_t> block(verity_data.desc->hash_block_size);
+  if (!ReadFullyAtOffset(fd, block.data(), block.size(), 0)) {
+    return false;
+  }
+  // dm-verity hashes the salt followed by the block.
+  bssl::ScopedEVP_MD_CTX ctx;
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  return EVP_DigestInit_ex(ctx.get(), md, nullptr) == 1 &&
+         EVP_DigestUpdate(ctx.get(), verity_data.salt.data(),
+                          verity_data.salt.size()) == 1 &&
+         EVP_DigestUpdate(ctx.get(), block.data(), block.size()) == 1 &&
+         EVP_DigestFinal_ex(ctx.get(), digest, &digest_size) == 1 &&
+         isRootDigest(digest, digest_size, verity_data);
+}
+
+// Returns the hash function of the hashtree of |verity_data|, if apexd can
+// generate and check it.
+StatusOr<const EVP_MD*> getHashFunction(const ApexVerityData& verity_data) {
+  using StatusM = StatusOr<const EVP_MD*>;
+  const AvbHashtreeDescriptor& desc = *verity_data.desc;
+  if (desc.data_block_size != desc.hash_block_size) {
+    return StatusM::Fail("data and hash block sizes differ");
+  }
+  const char* hash_algorithm =
+      reinterpret_cast<const char*>(desc.hash_algorithm);
+  const EVP_MD* md = HashTreeBuilder::HashFunction(std::string(
+      hash_algorithm, strnlen(hash_algorithm, sizeof(desc.hash_algorithm))));
+  if (md == nullptr) {
+    return StatusM::Fail("unsupported hash algorithm");
+  }
+  return StatusM(md);
+}
+
+Status generateHashTree(const ApexFile& apex,
+                        const ApexVerityData& verity_data,
+                        HashTreeBuilder& builder,
+                        const std::string& hashtree_file) {
+  const std::string& path = apex.GetPath();
+  unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() == -1) {
+    return Status::Fail(PStringLog() << "Failed to open " << path);
+  }
+  const uint64_t image_size = verity_data.desc->image_size;
+  const std::vector<uint8_t> salt(verity_data.salt.begin(),
+                                  verity_data.salt.end());
+  if (!builder.Initialize(image_size, salt)) {
+    return Status::Fail(StringLog()
+                        << "Failed to initialize hashtree of " << path);
+  }
+  std::vector<uint8_t> buffer(kHashTreeReadSize);
+  for (uint64_t offset = 0; offset < image_size;) {
+    const size_t size =
+        std::min(static_cast<uint64_t>(buffer.size()), image_size - offset);
+    if (!ReadFullyAtOffset(fd.get(), buffer.data(), size,
+                           apex.GetImageOffset() + offset)) {
+      return Status::Fail(PStringLog() << "Failed to read " << path);
+    }
+    if (!builder.Update(buffer.data(), size)) {
+      return Status::Fail(StringLog() << "Failed to hash " << path);
+    }
+    offset += size;
+  }
+  if (!builder.BuildHashTree()) {
+    return Status::Fail(StringLog() << "Failed to build hashtree of " << path);
+  }
+  const std::vector<unsigned char>& root_hash = builder.root_hash();
+  if (!isRootDigest(root_hash.data(), root_hash.size(), verity_data)) {
+    return Status::Fail(StringLog() << "Root digest of " << path
+                                    << " doesn't match its image");
+  }
+
+  // Written to a temporary file first, so that a crash can't leave a
+  // truncated hashtree behind.
+  const std::string tmp = hashtree_file + ".tmp";
+  unique_fd out(
+      open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (out.get() == -1) {
+    return Status::Fail(PStringLog() << "Failed to open " << tmp);
+  }
+  if (!builder.WriteHashTreeToFd(out.get(), 0) || fsync(out.get()) != 0) {
+    unlink(tmp.c_str());
+    return Status::Fail(PStringLog() << "Failed to write " << tmp);
+  }
+  if (rename(tmp.c_str(), hashtree_file.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return Status::Fail(PStringLog() << "Failed to rename " << tmp);
+  }
+  return Status::Success();
+}
+
+}  // namespace
+
+bool HasExternalHashTree(const ApexVerityData& verity_data) {
+  return verity_data.desc->tree_size == 0;
+}
+
+Status GenerateHashTree(const ApexFile& apex, const ApexVerityData& verity_data,
+                        const std::string& hashtree_file) {
+  StatusOr<const EVP_MD*> md = getHashFunction(verity_data);
+  if (!md.Ok()) {
+    return Status::Fail(StringLog() << "Can't generate hashtree of "
+                                    << apex.GetPath() << " : "
+                                    << md.ErrorMessage());
+  }
+  HashTreeBuilder builder(verity_data.desc->hash_block_size, *md);
+
+  unique_fd fd(open(hashtree_file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() != -1 &&
+      matchesRootDigest(fd.get(), verity_data, *md,
+                        builder.CalculateSize(verity_data.desc->image_size))) {
+    return Status::Success();
+  }
+  if (fd.get() == -1 && errno != ENOENT) {
+    return Status::Fail(PStringLog() << "Failed to open " << hashtree_file);
+  }
+
+  LOG(INFO) << "Generating hashtree of " << apex.GetPath() << " in "
+            << hashtree_file;
+  Status status = createDirIfNeeded(
+      std::filesystem::path(hashtree_file).parent_path(), 0700);
+  if (!status.Ok()) {
+    return status;
+  }
+  return generateHashTree(apex, verity_data, builder, hashtree_file);
+}
+
+Status VerifyHashTree(const ApexVerityData& verity_data,
+                      const std::string& hashtree_file) {
+  StatusOr<const EVP_MD*> md = getHashFunction(verity_data);
+  if (!md.Ok()) {
+    return md.ErrorStatus();
+  }
+  // Hashtrees are only generated when a package is staged, so a missing one
+  // isn't created here.
+  unique_fd fd(open(hashtree_file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() == -1) {
+    return Status::Fail(PStringLog() << "Failed to open " << hashtree_file);
+  }
+  HashTreeBuilder builder(verity_data.desc->hash_block_size, *md);
+  if (!matchesRootDigest(fd.get(), verity_data, *md,
+                         builder.CalculateSize(verity_data.desc->image_size))) {
+    return Status::Fail(StringLog() << hashtree_file
+                                    << " is not the hashtree of the image");
+  }
+  return Status::Success();
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEXD_VERITY_H_
+#define ANDROID_APEXD_APEXD_VERITY_H_
+
+#include <string>
+
+#include "apex_file.h"
+#include "status.h"
+
+namespace android {
+namespace apex {
+
+// Returns true if the image of a package was built without a hashtree. Its
+// hashtree is then generated by apexd and kept in kApexHashTreeDir.
+bool HasExternalHashTree(const ApexVerityData& verity_data);
+
+// Makes |hashtree_file| hold the hashtree of the image of |apex|, which must
+// have an external one. Only done when the package is staged. An existing
+// file is kept if its root digest matches |verity_data|. Otherwise the
+// hashtree is generated from the image, and is only written if its root
+// digest matches.
+Status GenerateHashTree(const ApexFile& apex, const ApexVerityData& verity_data,
+                        const std::string& hashtree_file);
+
+// Checks that |hashtree_file| exists and that its root digest matches
+// |verity_data|. Used on activation, which never writes hashtrees.
+Status VerifyHashTree(const ApexVerityData& verity_data,
+                      const std::string& hashtree_file);
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEXD_VERITY_H_
@@ -20,6 +20,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
@@ -34,10 +42,12 @@
 
 #include "apexd.h"
 #include "apexd_session.h"
+#include "apexd_trace.h"
 #include "status.h"
 #include "string_log.h"
 
 #include <android/apex/BnApexService.h>
+#include <android/apex/IApexSessionCallback.h>
 
 namespace android {
 namespace apex {
@@ -46,6 +56,38 @@ namespace {
 
 using BinderStatus = ::android::binder::Status;
 
+// Caches the result of a read-only query until the generation of the state it
+// is derived from changes. Callers that ask for the same generation while the
+// result is being computed wait for that computation instead of repeating it.
+template <typename T>
+class SnapshotCache {
+ public:
+  T Get(uint64_t generation, const std::function<T()>& compute) {
+    std::promise<T> promise;
+    std::shared_future<T> result;
+    bool is_owner = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // A caller that read an older generation can use a newer result.
+      if (!result_.valid() || generation > generation_) {
+        result_ = promise.get_future().share();
+        generation_ = generation;
+        is_owner = true;
+      }
+      result = result_;
+    }
+    if (is_owner) {
+      promise.set_value(compute());
+    }
+    return result.get();
+  }
+
+ private:
+  std::mutex mutex_;
+  uint64_t generation_ = 0;
+  std::shared_future<T> result_;
+};
+
 class ApexService : public BnApexService {
  public:
   using BinderStatus = ::android::binder::Status;
@@ -62,6 +104,9 @@ class ApexService : public BnApexService {
                                    const std::vector<int>& child_session_ids,
                                    ApexInfoList* apex_info_list,
                                    bool* aidl_return) override;
+  BinderStatus submitStagedSessionAsync(
+      int session_id, const std::vector<int>& child_session_ids,
+      const sp<IApexSessionCallback>& callback) override;
   BinderStatus markStagedSessionReady(int session_id,
                                       bool* aidl_return) override;
   BinderStatus markStagedSessionSuccessful(int session_id) override;
@@ -89,8 +134,61 @@ class ApexService : public BnApexService {
                       Parcel* _aidl_reply, uint32_t _aidl_flags) override;
 
   status_t shellCommand(int in, int out, int err, const Vector<String16>& args);
+
+ private:
+  // Runs |fn| on a worker thread, in the order of the calls, so that slow
+  // requests don't occupy a binder thread.
+  void RunAsync(std::function<void()> fn);
+
+  // Serializes session submissions, which clear sessions and back up the
+  // active packages.
+  std::mutex submit_mutex_;
+
+  // Snapshots of the read-only queries, which system_server issues in bursts.
+  SnapshotCache<std::vector<ApexSessionInfo>> sessions_cache_;
+  SnapshotCache<std::vector<ApexInfo>> active_packages_cache_;
+  SnapshotCache<std::vector<ApexInfo>> all_packages_cache_;
+
+  std::mutex async_mutex_;
+  std::condition_variable async_cv_;
+  std::deque<std::function<void()>> async_queue_;
+  bool async_thread_started_ = false;
 };
 
+void ApexService::RunAsync(std::function<void()> fn) {
+  std::lock_guard<std::mutex> lock(async_mutex_);
+  async_queue_.push_back(std::move(fn));
+  async_cv_.notify_one();
+  if (async_thread_started_) {
+    return;
+  }
+  // The service lives as long as the process, so the worker never exits.
+  std::thread([this]() {
+    while (true) {
+      std::function<void()> next;
+      {
+        std::unique_lock<std::mutex> worker_lock(async_mutex_);
+        async_cv_.wait(worker_lock, [this]() { return !async_queue_.empty(); });
+        next = std::move(async_queue_.front());
+        async_queue_.pop_front();
+      }
+      next();
+    }
+  }).detach();
+  async_thread_started_ = true;
+}
+
+void toApexInfoList(const std::vector<ApexFile>& packages,
+                    ApexInfoList* apex_info_list) {
+  for (const auto& package : packages) {
+    ApexInfo out;
+    out.packageName = package.GetManifest().name();
+    out.packagePath = package.GetPath();
+    out.versionCode = package.GetManifest().version();
+    apex_info_list->apexInfos.push_back(out);
+  }
+}
+
 BinderStatus CheckDebuggable(const std::string& name) {
   if (!::android::base::GetBoolProperty("ro.debuggable", false)) {
     std::string tmp = name + " unavailable";
@@ -155,6 +253,7 @@ BinderStatus ApexService::submitStagedSession(
   LOG(DEBUG) << "submitStagedSession() received by ApexService, session id "
              << session_id;
 
+  std::lock_guard<std::mutex> lock(submit_mutex_);
   StatusOr<std::vector<ApexFile>> packages =
       ::android::apex::submitStagedSession(session_id, child_session_ids);
   if (!packages.Ok()) {
@@ -164,17 +263,44 @@ BinderStatus ApexService::submitStagedSession(
     return BinderStatus::ok();
   }
 
-  for (const auto& package : *packages) {
-    ApexInfo out;
-    out.packageName = package.GetManifest().name();
-    out.packagePath = package.GetPath();
-    out.versionCode = package.GetManifest().version();
-    apex_info_list->apexInfos.push_back(out);
-  }
+  toApexInfoList(*packages, apex_info_list);
   *aidl_return = true;
   return BinderStatus::ok();
 }
 
+BinderStatus ApexService::submitStagedSessionAsync(
+    int session_id, const std::vector<int>& child_session_ids,
+    const sp<IApexSessionCallback>& callback) {
+  LOG(DEBUG) << "submitStagedSessionAsync() received by ApexService, "
+             << "session id " << session_id;
+  if (callback == nullptr) {
+    return BinderStatus::fromExceptionCode(BinderStatus::EX_ILLEGAL_ARGUMENT,
+                                           String8("callback is null"));
+  }
+
+  RunAsync([this, session_id, child_session_ids, callback]() {
+    std::lock_guard<std::mutex> lock(submit_mutex_);
+    auto progress = [&](size_t verified, size_t total) {
+      callback->onProgress(session_id, static_cast<int>(verified),
+                           static_cast<int>(total));
+    };
+    StatusOr<std::vector<ApexFile>> packages =
+        ::android::apex::submitStagedSession(session_id, child_session_ids,
+                                             progress);
+    if (!packages.Ok()) {
+      LOG(ERROR) << "Failed to submit session id " << session_id << ": "
+                 << packages.ErrorMessage();
+      callback->onSessionFailed(session_id, packages.ErrorMessage());
+      return;
+    }
+
+    ApexInfoList apex_info_list;
+    toApexInfoList(*packages, &apex_info_list);
+    callback->onSessionVerified(session_id, apex_info_list);
+  });
+  return BinderStatus::ok();
+}
+
 BinderStatus ApexService::markStagedSessionReady(int session_id,
                                                  bool* aidl_return) {
   LOG(DEBUG) << "markStagedSessionReady() received by ApexService, session id "
@@ -277,25 +403,18 @@ static std::string toString(const ApexInfo& package) {
   return msg;
 }
 
-static bool contains(const std::vector<ApexFile>& list,
-                     const ApexFile& apexFile) {
-  return std::find_if(list.begin(), list.end(),
-                      [&apexFile](const ApexFile& listFile) {
-                        return apexFile.GetManifest().name().compare(
-                                   listFile.GetManifest().name()) == 0 &&
-                               apexFile.GetManifest().version() ==
-                                   listFile.GetManifest().version();
-                      }) != list.end();
-}
-
 BinderStatus ApexService::getSessions(
     std::vector<ApexSessionInfo>* aidl_return) {
-  auto sessions = ApexSession::GetSessions();
-  for (const auto& session : sessions) {
-    ApexSessionInfo sessionInfo;
-    convertToApexSessionInfo(session, &sessionInfo);
-    aidl_return->push_back(sessionInfo);
-  }
+  const uint64_t generation = ApexSession::GetSessionsGeneration();
+  *aidl_return = sessions_cache_.Get(generation, []() {
+    std::vector<ApexSessionInfo> ret;
+    for (const auto& session : ApexSession::GetSessions()) {
+      ApexSessionInfo sessionInfo;
+      convertToApexSessionInfo(session, &sessionInfo);
+      ret.push_back(std::move(sessionInfo));
+    }
+    return ret;
+  });
 
   return BinderStatus::ok();
 }
@@ -363,14 +482,18 @@ BinderStatus ApexService::deactivatePackage(const std::string& packagePath) {
 
 BinderStatus ApexService::getActivePackages(
     std::vector<ApexInfo>* aidl_return) {
-  auto packages = ::android::apex::getActivePackages();
-  for (const auto& package : packages) {
-    ApexInfo apexInfo = getApexInfo(package);
-    apexInfo.isActive = true;
-    apexInfo.isFactory =
-        ::android::apex::isPathForBuiltinApexes(package.GetPath());
-    aidl_return->push_back(std::move(apexInfo));
-  }
+  const uint64_t generation = ::android::apex::getActivePackagesGeneration();
+  *aidl_return = active_packages_cache_.Get(generation, []() {
+    std::vector<ApexInfo> ret;
+    for (const auto& package : ::android::apex::getActivePackages()) {
+      ApexInfo apexInfo = getApexInfo(package);
+      apexInfo.isActive = true;
+      apexInfo.isFactory =
+          ::android::apex::isPathForBuiltinApexes(package.GetPath());
+      ret.push_back(std::move(apexInfo));
+    }
+    return ret;
+  });
 
   return BinderStatus::ok();
 }
@@ -392,27 +515,36 @@ BinderStatus ApexService::getActivePackage(const std::string& packageName,
 }
 
 BinderStatus ApexService::getAllPackages(std::vector<ApexInfo>* aidl_return) {
-  auto activePackages = ::android::apex::getActivePackages();
-  auto factoryPackages = ::android::apex::getFactoryPackages();
-  for (const ApexFile& factoryFile : factoryPackages) {
-    ApexInfo apexInfo = getApexInfo(factoryFile);
-    apexInfo.isFactory = true;
-    if (contains(activePackages, factoryFile)) {
-      apexInfo.isActive = true;
-    } else {
-      apexInfo.isActive = false;
+  // Factory packages live on read-only partitions, so only the active ones can
+  // change.
+  const uint64_t generation = ::android::apex::getActivePackagesGeneration();
+  *aidl_return = all_packages_cache_.Get(generation, []() {
+    std::vector<ApexInfo> ret;
+    auto activePackages = ::android::apex::getActivePackages();
+    std::unordered_set<std::string> activeIds;
+    for (const ApexFile& activeFile : activePackages) {
+      activeIds.insert(GetPackageId(activeFile.GetManifest()));
+    }
+    for (const ApexFile& factoryFile : ::android::apex::getFactoryPackages()) {
+      ApexInfo apexInfo = getApexInfo(factoryFile);
+      apexInfo.isFactory = true;
+      apexInfo.isActive =
+          activeIds.count(GetPackageId(factoryFile.GetManifest())) != 0;
+      ret.push_back(std::move(apexInfo));
     }
-    aidl_return->push_back(std::move(apexInfo));
-  }
 
-  for (const ApexFile& activeFile : activePackages) {
-    if (!contains(factoryPackages, activeFile)) {
-      ApexInfo apexInfo = getApexInfo(activeFile);
-      apexInfo.isFactory = false;
-      apexInfo.isActive = true;
-      aidl_return->push_back(std::move(apexInfo));
+    for (const ApexFile& activeFile : activePackages) {
+      const ApexManifest& manifest = activeFile.GetManifest();
+      if (::android::apex::getFactoryPackage(manifest.name(),
+                                             manifest.version()) == nullptr) {
+        ApexInfo apexInfo = getApexInfo(activeFile);
+        apexInfo.isFactory = false;
+        apexInfo.isActive = true;
+        ret.push_back(std::move(apexInfo));
+      }
     }
-  }
+    return ret;
+  });
   return BinderStatus::ok();
 }
 
@@ -558,6 +690,9 @@ status_t ApexService::dump(int fd, const Vector<String16>& args) {
     dprintf(fd, "%s", msg.c_str());
   }
 
+  dprintf(fd, "ACTIVATION TIMELINE:\n");
+  dprintf(fd, "%s", trace::DumpTimeline().c_str());
+
   return OK;
 }
 
@@ -600,6 +735,9 @@ status_t ApexService::shellCommand(int in, int out, int err,
            "given session previously submitted"
         << "  submitStagedSession [sessionId] - attempts to submit the "
            "installer session with given id"
+        << std::endl
+        << "  getActivationTimeline - displays how long each phase of "
+           "activating each package took"
         << std::endl;
     dprintf(fd, "%s", log.operator std::string().c_str());
   };
@@ -822,6 +960,15 @@ status_t ApexService::shellCommand(int in, int out, int err,
     return BAD_VALUE;
   }
 
+  if (cmd == String16("getActivationTimeline")) {
+    if (args.size() != 1) {
+      print_help(err, "Unrecognized options");
+      return BAD_VALUE;
+    }
+    dprintf(out, "%s", trace::DumpTimeline().c_str());
+    return OK;
+  }
+
   if (cmd == String16("help")) {
     if (args.size() != 1) {
       print_help(err, "Help has no options");
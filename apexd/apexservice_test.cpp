@@ -14,12 +14,16 @@
  * limitations under the License.
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -37,12 +41,14 @@
 #include <android-base/strings.h>
 #include <android/os/IVold.h>
 #include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <libdm/dm.h>
 #include <selinux/selinux.h>
 
 #include <android/apex/ApexInfo.h>
+#include <android/apex/BnApexSessionCallback.h>
 #include <android/apex/IApexService.h>
 
 #include "apex_constants.h"
@@ -540,6 +546,34 @@ TEST_F(ApexServiceTest, StageSuccess) {
   EXPECT_TRUE(RegularFileExists(installer.test_installed_file));
 }
 
+TEST_F(ApexServiceTest, StageKeepsActiveDirLabel) {
+  if (!HaveSelinux()) {
+    LOG(WARNING) << "Skipping StageKeepsActiveDirLabel because of selinux";
+    return;
+  }
+  auto get_label = []() {
+    char* label = nullptr;
+    if (getfilecon(kActiveApexPackagesDataDir, &label) < 0) {
+      return std::string();
+    }
+    std::string ret(label);
+    freecon(label);
+    return ret;
+  };
+  const std::string label = get_label();
+  ASSERT_FALSE(label.empty()) << strerror(errno);
+
+  PrepareTestApexForInstall installer(GetTestFile("apex.apexd_test.apex"));
+  if (!installer.Prepare()) {
+    return;
+  }
+  bool success;
+  ASSERT_TRUE(IsOk(service_->stagePackage(installer.test_file, &success)));
+  ASSERT_TRUE(success);
+  // The active directory is replaced when packages are staged.
+  EXPECT_EQ(label, get_label());
+}
+
 TEST_F(ApexServiceTest,
        SubmitStagegSessionSuccessDoesNotLeakTempVerityDevices) {
   using android::dm::DeviceMapper;
@@ -948,6 +982,62 @@ TEST_F(ApexServiceActivationSuccessTest, DmDeviceTearDown) {
   installer_.reset();  // Skip TearDown deactivatePackage.
 }
 
+struct NoHashTreeNameProvider {
+  static std::string GetTestName() {
+    return "apex.apexd_test_no_hashtree.apex";
+  }
+  static std::string GetPackageName() {
+    return "com.android.apex.test_package";
+  }
+};
+
+class ApexServiceNoHashTreeTest
+    : public ApexServiceActivationTest<NoHashTreeNameProvider> {};
+
+TEST_F(ApexServiceNoHashTreeTest, ActivateAndUninstall) {
+  const std::string hashtree_file =
+      StringPrintf("%s/%s@%" PRIu64, kApexHashTreeDir,
+                   installer_->package.c_str(), installer_->version);
+  // Generated when the package was staged.
+  ASSERT_TRUE(RegularFileExists(hashtree_file));
+
+  ASSERT_TRUE(IsOk(service_->activatePackage(installer_->test_installed_file)))
+      << GetDebugStr(installer_.get());
+  {
+    StatusOr<bool> active = IsActive(installer_->package, installer_->version);
+    ASSERT_TRUE(IsOk(active));
+    ASSERT_TRUE(*active) << Join(GetActivePackagesStrings(), ',');
+  }
+
+  ASSERT_TRUE(
+      IsOk(service_->deactivatePackage(installer_->test_installed_file)));
+  ASSERT_TRUE(
+      IsOk(service_->unstagePackages({installer_->test_installed_file})));
+  EXPECT_FALSE(RegularFileExists(installer_->test_installed_file));
+  EXPECT_FALSE(RegularFileExists(hashtree_file));
+
+  installer_.reset();  // Skip TearDown deactivatePackage.
+}
+
+TEST_F(ApexServiceNoHashTreeTest, StaleHashTreeIsNotRegenerated) {
+  const std::string hashtree_file =
+      StringPrintf("%s/%s@%" PRIu64, kApexHashTreeDir,
+                   installer_->package.c_str(), installer_->version);
+  ASSERT_TRUE(RegularFileExists(hashtree_file));
+  ASSERT_TRUE(android::base::WriteStringToFile("stale", hashtree_file));
+
+  // Activation never writes hashtrees, so it fails instead.
+  ASSERT_FALSE(
+      IsOk(service_->activatePackage(installer_->test_installed_file)));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(hashtree_file, &content));
+  EXPECT_EQ("stale", content);
+
+  ASSERT_TRUE(
+      IsOk(service_->unstagePackages({installer_->test_installed_file})));
+  installer_.reset();  // Skip TearDown deactivatePackage.
+}
+
 class ApexServicePrePostInstallTest : public ApexServiceTest {
  public:
   template <typename Fn>
@@ -1098,6 +1188,98 @@ TEST_F(ApexServiceTest, SubmitSingleSessionTestSuccess) {
   ASSERT_THAT(sessions, UnorderedElementsAre(SessionInfoEq(expected)));
 }
 
+// Records what submitStagedSessionAsync reports.
+class TestSessionCallback : public android::apex::BnApexSessionCallback {
+ public:
+  android::binder::Status onProgress(int session_id ATTRIBUTE_UNUSED,
+                                     int verified, int total) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    progress_.emplace_back(verified, total);
+    return android::binder::Status::ok();
+  }
+
+  android::binder::Status onSessionVerified(
+      int session_id ATTRIBUTE_UNUSED, const ApexInfoList& packages) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    verified_ = true;
+    packages_ = packages;
+    done_ = true;
+    cv_.notify_all();
+    return android::binder::Status::ok();
+  }
+
+  android::binder::Status onSessionFailed(
+      int session_id ATTRIBUTE_UNUSED,
+      const std::string& error_message) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_message_ = error_message;
+    done_ = true;
+    cv_.notify_all();
+    return android::binder::Status::ok();
+  }
+
+  // Returns false if no result was reported in time.
+  bool WaitForResult() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, std::chrono::seconds(60),
+                        [this]() { return done_; });
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool done_ = false;
+  bool verified_ = false;
+  ApexInfoList packages_;
+  std::string error_message_;
+  std::vector<std::pair<int, int>> progress_;
+};
+
+TEST_F(ApexServiceTest, SubmitSingleSessionAsyncTestSuccess) {
+  PrepareTestApexForInstall installer(GetTestFile("apex.apexd_test.apex"),
+                                      "/data/app-staging/session_123",
+                                      "staging_data_file");
+  if (!installer.Prepare()) {
+    FAIL() << GetDebugStr(&installer);
+  }
+
+  sp<TestSessionCallback> callback = new TestSessionCallback();
+  std::vector<int> empty_child_session_ids;
+  ASSERT_TRUE(IsOk(service_->submitStagedSessionAsync(
+      123, empty_child_session_ids, callback)))
+      << GetDebugStr(&installer);
+  ASSERT_TRUE(callback->WaitForResult()) << GetDebugStr(&installer);
+
+  std::lock_guard<std::mutex> lock(callback->mutex_);
+  ASSERT_TRUE(callback->verified_) << callback->error_message_;
+  ASSERT_EQ(1u, callback->packages_.apexInfos.size());
+  const ApexInfo& info = callback->packages_.apexInfos[0];
+  EXPECT_EQ(installer.package, info.packageName);
+  EXPECT_EQ(installer.version, static_cast<uint64_t>(info.versionCode));
+  EXPECT_EQ(installer.test_file, info.packagePath);
+  EXPECT_THAT(callback->progress_,
+              UnorderedElementsAre(std::make_pair(1, 1)));
+
+  ApexSessionInfo session;
+  ASSERT_TRUE(IsOk(service_->getStagedSessionInfo(123, &session)))
+      << GetDebugStr(&installer);
+  ApexSessionInfo expected = CreateSessionInfo(123);
+  expected.isVerified = true;
+  EXPECT_THAT(session, SessionInfoEq(expected));
+}
+
+TEST_F(ApexServiceTest, SubmitSessionAsyncTestFail) {
+  sp<TestSessionCallback> callback = new TestSessionCallback();
+  std::vector<int> empty_child_session_ids;
+  // There is no /data/app-staging/session_456.
+  ASSERT_TRUE(IsOk(service_->submitStagedSessionAsync(
+      456, empty_child_session_ids, callback)));
+  ASSERT_TRUE(callback->WaitForResult());
+
+  std::lock_guard<std::mutex> lock(callback->mutex_);
+  EXPECT_FALSE(callback->verified_);
+  EXPECT_FALSE(callback->error_message_.empty());
+}
+
 TEST_F(ApexServiceTest, SubmitSingleStagedSessionDeletesPreviousSessions) {
   PrepareTestApexForInstall installer(GetTestFile("apex.apexd_test.apex"),
                                       "/data/app-staging/session_239",
@@ -1267,6 +1449,33 @@ TEST_F(ApexServiceTest, SubmitMultiSessionTestFail) {
 }
 #endif
 
+TEST_F(ApexServiceTest, SubmitMultiSessionDuplicatePackageFails) {
+  // Parent session id: 12
+  // Children session ids: 22 32, both staging the same package.
+  PrepareTestApexForInstall installer(GetTestFile("apex.apexd_test.apex"),
+                                      "/data/app-staging/session_22",
+                                      "staging_data_file");
+  PrepareTestApexForInstall installer2(GetTestFile("apex.apexd_test.apex"),
+                                       "/data/app-staging/session_32",
+                                       "staging_data_file");
+  if (!installer.Prepare() || !installer2.Prepare()) {
+    FAIL() << GetDebugStr(&installer) << GetDebugStr(&installer2);
+  }
+  ApexInfoList list;
+  bool ret_value;
+  std::vector<int> child_session_ids = {22, 32};
+  ASSERT_TRUE(IsOk(
+      service_->submitStagedSession(12, child_session_ids, &list, &ret_value)))
+      << GetDebugStr(&installer);
+  ASSERT_FALSE(ret_value);
+
+  ApexSessionInfo session;
+  ASSERT_TRUE(IsOk(service_->getStagedSessionInfo(12, &session)));
+  ApexSessionInfo expected = CreateSessionInfo(-1);
+  expected.isUnknown = true;
+  ASSERT_THAT(session, SessionInfoEq(expected));
+}
+
 TEST_F(ApexServiceTest, MarkStagedSessionReadyFail) {
   // We should fail if we ask information about a session we don't know.
   bool ret_value;
@@ -2112,5 +2321,7 @@ int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   ::testing::UnitTest::GetInstance()->listeners().Append(
       new android::apex::LogTestToLogcat());
+  // Needed to receive callbacks from apexd.
+  android::ProcessState::self()->startThreadPool();
   return RUN_ALL_TESTS();
 }